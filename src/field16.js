@@ -0,0 +1,154 @@
+/* Browser side of fifo_field2d/encode_field16, served as /field16.js by fifofum.py and by the embedded server
+   of fifo_c.c, which both precede it with the definition of field16Viridis (the 240 colors of VIRIDIS_PLUS_CMAP).
+
+   16-bit fields ('data:image/png;field16offset=offset;field16scale=scale;base64,...', see encode_field16):
+   red = high byte, green = low byte of quantized value q (0 for undefined), value = offset + scale*(q-1).
+   Colormap, range and opacity are applied in the browser, using a lookup table indexed by q.
+   The colormaps are those of fifo_plot2d (nearest of 240 colors), so both show the same data in the same colors */
+var field16Colormaps = {viridis: field16Viridis, grayscale: [], grayalpha: []};
+var field16State = {};
+
+(function() {
+    /* Grayscale colormaps as in fifo_plot2d (grayalpha uses the gray level as alpha) */
+    for (var k = 0; k < 240; k++) {
+        var gray = Math.floor(255*k/239);
+        field16Colormaps.grayscale.push([gray, gray, gray]);
+        field16Colormaps.grayalpha.push([gray, gray, gray, gray]);
+    }
+})();
+
+function field16_param(content, name) {
+    /* Returns value of numeric parameter in data URL header (before the comma) */
+    var params = content.substring(0, content.indexOf(',')).split(';');
+    for (var i = 0; i < params.length; i++) {
+        if (params[i].substr(0, name.length+1) === name+'=')
+            return parseFloat(params[i].substr(name.length+1));
+    }
+    return NaN;
+}
+
+function field16_image(pipeName, content, onrender) {
+    var offset = field16_param(content, 'field16offset');
+    var scale = field16_param(content, 'field16scale');
+    var img = new Image();
+    img.onload = function() {
+        var canvas = document.createElement('canvas');
+        canvas.width = img.width;
+        canvas.height = img.height;
+        var ctx = canvas.getContext('2d');
+        ctx.drawImage(img, 0, 0);
+        var rgba = ctx.getImageData(0, 0, img.width, img.height).data;
+        var q = new Uint16Array(img.width*img.height);
+        for (var i = 0; i < q.length; i++)
+            q[i] = (rgba[4*i] << 8) | rgba[4*i+1];
+        var state = field16_setup(pipeName);
+        state.q = q;
+        state.width = img.width;
+        state.height = img.height;
+        state.offset = offset;
+        state.scale = scale;
+        state.min.placeholder = state.offset.toPrecision(5);
+        state.max.placeholder = (state.offset + 65534*state.scale).toPrecision(5);
+        field16_render(state);
+        if (onrender)
+            onrender();
+    };
+    img.src = content;
+}
+
+function field16_setup(pipeName) {
+    /* Creates display canvas and controls for channel */
+    var state = field16State[pipeName];
+    if (state)
+        return state;
+    var img = document.getElementById('img_'+pipeName);
+    var controls = document.createElement('div');
+    controls.innerHTML = 'Colormap <select><option>viridis</option><option>grayscale</option><option>grayalpha</option></select>' +
+        ' reverse <input type="checkbox"> min <input type="text" size="8"> max <input type="text" size="8">' +
+        ' opacity <input type="range" min="0" max="1" step="0.05" value="1"> <span></span>';
+    var canvas = document.createElement('canvas');
+    canvas.style.display = 'block';
+    canvas.style.maxWidth = img.style.maxWidth;
+    canvas.style.backgroundImage = img.style.backgroundImage;
+    canvas.style.backgroundSize = img.style.backgroundSize;
+    img.parentNode.insertBefore(controls, img);
+    img.parentNode.insertBefore(canvas, img);
+    img.style.display = 'none';
+
+    var inputs = controls.getElementsByTagName('input');
+    state = {canvas: canvas, colormap: controls.getElementsByTagName('select')[0], reverse: inputs[0],
+             min: inputs[1], max: inputs[2], opacity: inputs[3], readout: controls.getElementsByTagName('span')[0]};
+    var rerender = function() { field16_render(state); };
+    state.colormap.onchange = rerender;
+    state.reverse.onchange = rerender;
+    state.min.onchange = rerender;
+    state.max.onchange = rerender;
+    state.opacity.oninput = rerender;
+
+    canvas.onmousemove = function(evt) {
+        /* Value readout */
+        var rect = canvas.getBoundingClientRect();
+        var x = Math.floor((evt.clientX - rect.left) * state.width / rect.width);
+        var y = Math.floor((evt.clientY - rect.top) * state.height / rect.height);
+        if (!state.q || x < 0 || y < 0 || x >= state.width || y >= state.height)
+            return;
+        var q = state.q[x + state.width*y];
+        state.readout.textContent = '(' + x + ', ' + y + ') = ' +
+            (q ? (state.offset + state.scale*(q-1)).toPrecision(6) : 'undefined');
+    };
+    field16State[pipeName] = state;
+    return state;
+}
+
+function field16_render(state) {
+    /* Colors quantized field using lookup table for current colormap, range and opacity
+       (the table is rebuilt only when these, or the quantized range of the min/max entries, change) */
+    if (!state.q)
+        return;
+    var stops = field16Colormaps[state.colormap.value];
+    var opacity = parseFloat(state.opacity.value);
+    var lo = 1, hi = 65535;
+    if (state.scale > 0 && state.min.value !== '' && isFinite(state.min.value))
+        lo = 1 + (parseFloat(state.min.value) - state.offset) / state.scale;
+    if (state.scale > 0 && state.max.value !== '' && isFinite(state.max.value))
+        hi = 1 + (parseFloat(state.max.value) - state.offset) / state.scale;
+    if (hi <= lo)
+        hi = lo + 1;
+
+    var key = [state.colormap.value, state.reverse.checked, lo, hi, opacity].join(' ');
+    if (state.lutKey !== key) {
+        state.lut = field16_lut(stops, state.reverse.checked, lo, hi, opacity);
+        state.lutKey = key;
+    }
+    var lut = state.lut;
+
+    var canvas = state.canvas;
+    if (canvas.width !== state.width || canvas.height !== state.height) {
+        canvas.width = state.width;
+        canvas.height = state.height;
+    }
+    var ctx = canvas.getContext('2d');
+    var imageData = ctx.createImageData(state.width, state.height);
+    var out = new Uint32Array(imageData.data.buffer);
+    for (var i = 0; i < out.length; i++)
+        out[i] = lut[state.q[i]];
+    ctx.putImageData(imageData, 0, 0);
+}
+
+function field16_lut(stops, reverse, lo, hi, opacity) {
+    /* Returns RGBA lookup table indexed by quantized value, for colormap stops and range lo..hi of q
+       (each value uses the nearest color, as color_index in fifo_f.f90) */
+    var lut = new Uint32Array(65536);
+    var little = new Uint8Array(new Uint32Array([1]).buffer)[0] === 1;
+    for (var q = 1; q < 65536; q++) {
+        var f = Math.min(1, Math.max(0, (q - lo) / (hi - lo)));
+        if (reverse)
+            f = 1 - f;
+        var stop = stops[Math.round(f*(stops.length-1))];
+        var c = [stop[0], stop[1], stop[2], Math.round(((stop.length > 3) ? stop[3] : 255)*opacity)];
+        lut[q] = little ? ((c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0]) >>> 0
+                        : ((c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3]) >>> 0;
+    }
+    lut[0] = 0;   /* Undefined values are transparent */
+    return lut;
+}
@@ -6,6 +6,10 @@
  -DDEBUG_FIFO for debug trace output
  -DFIFO_BLOCKING for blocking writes to named pipe
  -DFIFO_NO_PNG for compiling without the PNG library (display raw uncompressed images)
+ -DFIFO_SERVER for the embedded HTTP/WebSocket server thread (Linux only; link with -lpthread)
+ -DTEST_SERVER for serving test output via the embedded server (requires -DFIFO_SERVER)
+ -DTEST_SOCKET for writing test output to the socket pipe testout.sock (requires -DFIFO_SERVER)
+ -DFIFO_THREADS for the registered field sampler thread (link with -lpthread; implied by -DFIFO_SERVER)
 
   To test:
       cc -DTEST_MAIN  fifo_c.c -lpng
@@ -26,21 +30,44 @@
       python fifofum.py --input=testin.fifo testout.fifo  # Load http://localhost:8008
 
       python fifofum.py --multiplex=1 --input=testin.fifo testout.fifo  # Load http://localhost:8008 for multi-channel output
+
+      # For web display without fifofum.py (embedded server)
+
+      cc -DTEST_MAIN -DFIFO_SERVER -DTEST_SERVER fifo_c.c -lpng -lpthread
+      ./a.out   # Load http://localhost:8008
+
+      # For multiple readers (via Unix domain socket)
+
+      cc -DTEST_MAIN -DFIFO_SERVER -DTEST_SOCKET fifo_c.c -lpng -lpthread
+      python fifofum.py --input=testin.fifo testout.sock  # Load http://localhost:8008
+      socat - UNIX-CONNECT:testout.sock    # in a different terminal
  */
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(FIFO_SERVER) && !defined(FIFO_THREADS)
+#define FIFO_THREADS
+#endif
+
+#ifdef FIFO_THREADS
+#include <pthread.h>
+#endif
+
 /* Fortran-accessible GLOBAL variables (not static) */
 /* Encoding values GLOBAL */
 int NO_ENC        =  0; /* none (raw bytes) */
@@ -49,6 +76,11 @@ int DATA_URL_ENC  =  2; /* Base64 with image data URL prefix+new line suffix (fo
 int B64_LINE_ENC  = -1; /* Base64, broken into 80 character lines */
 int GRAPHTERM_ENC = -2; /* Base64 with GraphTerm prefix and suffix */
 
+/* Scale mode values GLOBAL (see quantize_field) */
+int LINEAR_SCALE  =  0; /* linear */
+int LOG_SCALE     =  1; /* logarithmic (non-positive values use the first color) */
+int SYMLOG_SCALE  =  2; /* symmetric logarithmic (linear near zero) */
+
 /* Viridis color map (256 RGB triplets) from matplotlib (https://github.com/BIDS/colormap/blob/master/option_d.py) GLOBAL */
 int VIRIDIS_CMAP[3*256] = {
  68,  1, 84,   68,  2, 86,   69,  4, 87,   69,  5, 89,   70,  7, 90,   70,  8, 92,   70, 10, 93,   70, 11, 94,  
@@ -138,12 +170,44 @@ int VIRIDIS_PLUS_CMAP[3*256] = {
 #define GRAPHTERM_SUFFIX "\x1b[?1155l"
 
 #define FIFO_LINEMAX 80
+#define FIFO_NAMEMAX 64
+#define FIFO_PATHMAX 1024
+
+/* Sink values (for pipes that are consumed within the library, rather than via a file descriptor) */
+#define NO_SINK      0
+#define SERVER_SINK  1  /* embedded HTTP/WebSocket server */
+#define SOCKET_SINK  2  /* Unix domain socket with multiple readers */
+#define FILE_SINK    3  /* latest frame file (written to temporary file and renamed) */
+#define MMAP_SINK    4  /* latest frame in double-buffered memory-mapped file */
+
+/* Memory-mapped file layout (see allocate_mmap_pipe): header, followed by two frame slots of slot_size bytes */
+#define FIFO_MMAP_MAGIC  "FIFOMMAP"
+#define FIFO_MMAP_HDRLEN 64
+
+struct mmap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t seq;                    /*  number of frames published */
+    uint32_t active;                 /*  slot containing latest frame (0 or 1) */
+    uint32_t len[2];                 /*  frame length in each slot */
+};
 
 struct pipe_buffer {
     int pipe_num;
     int write_fd;
     int keep_open;
     int encoding;
+    int sink;
+
+    char *frame_buf;                 /*  line/frame assembly buffer (for sinks) */
+    int frame_len;
+    int frame_maxlen;
+    char channel[FIFO_NAMEMAX];      /*  current channel name (for sinks and subscriptions) */
+    char *path;                      /*  file path (for FILE_SINK) */
+    int fsync;                       /*  fsync after each frame */
+    char *mmap_ptr;                  /*  mapped file (for MMAP_SINK) */
+    int mmap_len;
 
     unsigned char *stream_ptr;       /*  location to write image stream  */
     int stream_len;                  /*  number of bytes written       */
@@ -153,6 +217,12 @@ struct pipe_buffer {
     int raw_len;
     char encoded_line[FIFO_LINEMAX];     /* Base64 encoded line */
     int line_len;                    /*  number of bytes written       */
+
+    int tile_seq;                    /*  sequence number of last tile written */
+    int tile_pending;                /*  next image is a tile (always encoded at full resolution) */
+
+    long long trace_start;           /*  start time of frame being traced (0 if none; see set_fifo_trace) */
+    int trace_seq;                   /*  sequence number of last frame traced */
 };
 
 typedef struct pipe_buffer pipe_buffer;
@@ -170,6 +240,22 @@ void reset_pipe(int pipe_num)
     pipe_list[pipe_num].write_fd = -1;
     pipe_list[pipe_num].keep_open = 0;
     pipe_list[pipe_num].encoding = 0;
+    pipe_list[pipe_num].sink = NO_SINK;
+
+    if (pipe_list[pipe_num].frame_buf)
+        free(pipe_list[pipe_num].frame_buf);
+    pipe_list[pipe_num].frame_buf = NULL;
+    pipe_list[pipe_num].frame_len = 0;
+    pipe_list[pipe_num].frame_maxlen = 0;
+    pipe_list[pipe_num].channel[0] = '\0';
+    if (pipe_list[pipe_num].path)
+        free(pipe_list[pipe_num].path);
+    pipe_list[pipe_num].path = NULL;
+    pipe_list[pipe_num].fsync = 0;
+    if (pipe_list[pipe_num].mmap_ptr)
+        munmap(pipe_list[pipe_num].mmap_ptr, pipe_list[pipe_num].mmap_len);
+    pipe_list[pipe_num].mmap_ptr = NULL;
+    pipe_list[pipe_num].mmap_len = 0;
 
     pipe_list[pipe_num].stream_ptr = NULL;
     pipe_list[pipe_num].stream_len = 0;
@@ -177,13 +263,26 @@ void reset_pipe(int pipe_num)
 
     pipe_list[pipe_num].raw_len = 0;
     pipe_list[pipe_num].line_len = 0;
+
+    pipe_list[pipe_num].tile_seq = 0;
+    pipe_list[pipe_num].tile_pending = 0;
+
+    pipe_list[pipe_num].trace_start = 0;
+    pipe_list[pipe_num].trace_seq = 0;
 }
 
 
+static int trace_enabled = 0;
+
 void init_pipes()
 {
     int i;
+    const char *trace_env;
+
     initialized = 1;
+    trace_env = getenv("FIFO_TRACE");
+    if (trace_env && atoi(trace_env) > 0)
+        trace_enabled = 1;
     for (i=0; i<FIFO_MAX_PIPES; i++)
       reset_pipe(i);
 }
@@ -199,7 +298,7 @@ int check_pipe_num(int pipe_num)
     if (pipe_num < 0 || pipe_num >= FIFO_MAX_PIPES)
       return 0;
 
-    if (pipe_list[pipe_num].write_fd < 0 && pipe_list[pipe_num].stream_ptr == NULL)
+    if (pipe_list[pipe_num].write_fd < 0 && pipe_list[pipe_num].stream_ptr == NULL && !pipe_list[pipe_num].sink)
       return 0; /* Pipe not active */
 
     return 1;
@@ -213,7 +312,7 @@ int get_available_pipe()
     check_pipe_num(0);
   
     for (i=0; i<FIFO_MAX_PIPES; i++) {
-        if (pipe_list[i].write_fd < 0 && pipe_list[i].stream_ptr == NULL) {
+        if (pipe_list[i].write_fd < 0 && pipe_list[i].stream_ptr == NULL && !pipe_list[i].sink) {
 	    reset_pipe(i);
 	    return i;
 	}
@@ -222,6 +321,9 @@ int get_available_pipe()
 }
 
 
+void socket_release(int pipe_num);
+int end_frame(int pipe_num);
+
 void free_pipe(int pipe_num)
 {
 
@@ -232,6 +334,10 @@ void free_pipe(int pipe_num)
     if (check_pipe_num(pipe_num)) {
       if (pipe_list[pipe_num].write_fd >= 0)
         close(pipe_list[pipe_num].write_fd);
+      if (pipe_list[pipe_num].sink == SOCKET_SINK)
+        socket_release(pipe_num);
+      if (pipe_list[pipe_num].sink == FILE_SINK && pipe_list[pipe_num].frame_len)
+        end_frame(pipe_num);  /* Publish pending text */
     }
 
     reset_pipe(pipe_num);
@@ -246,25 +352,55 @@ void free_all_pipes()
 }
 
 
-/* Flush pipe */
+/* Flush pipe (fsync only if enabled by set_pipe_fsync) */
 void flush_pipe(int pipe_num)
 {
     if (!check_pipe_num(pipe_num))
         return;
 
-    if (pipe_list[pipe_num].write_fd < 0)
+    if (pipe_list[pipe_num].write_fd < 0 || !pipe_list[pipe_num].fsync)
       return;
 
   fsync(pipe_list[pipe_num].write_fd);
 }
 
 
+/* Fortran-callable function to enable (1) or disable (0, default) fsync for each flush/frame written to file pipe.
+Returns 0 on success, or -1 on error.
+*/
+int set_pipe_fsync(int pipe_num, int enable)
+{
+    if (!check_pipe_num(pipe_num))
+        return -1;
+
+    pipe_list[pipe_num].fsync = enable;
+    return 0;
+}
+
+
+void sink_data(pipe_buffer *bufr, const char *data, int length);
+void set_channel_name(pipe_buffer *bufr, const char *line, int length);
+
 /* Write to pipe, returning number of bytes written, or -1 on error */
 int write_to_pipe(int pipe_num, const void *buf, int nbyte)
 {
+    const char *eol;
+
     if (!check_pipe_num(pipe_num))
         return -1;
 
+    if (nbyte >= 8 && strncmp(buf, "channel:", 8) == 0 &&
+        pipe_list[pipe_num].sink != SERVER_SINK && pipe_list[pipe_num].sink != SOCKET_SINK) {
+        /* Track channel of multiplexed pipe (for subscriptions) */
+        eol = memchr(buf, '\n', nbyte);
+        set_channel_name(&pipe_list[pipe_num], buf, eol ? (int)(eol - (const char *) buf) : nbyte);
+    }
+
+    if (pipe_list[pipe_num].sink) {
+        sink_data(&pipe_list[pipe_num], buf, nbyte);
+        return nbyte;
+    }
+
     if (pipe_list[pipe_num].write_fd < 0)
       return -1;
 
@@ -276,9 +412,23 @@ int write_to_pipe(int pipe_num, const void *buf, int nbyte)
 int write_to_pipe_formatted(int pipe_num, const char *format, ...)
 {
     int status;
+    char line[FIFO_LINEMAX*4];
+
     if (!check_pipe_num(pipe_num))
         return -1;
 
+    if (pipe_list[pipe_num].sink) {
+        va_list args;
+        va_start (args, format);
+        status = vsnprintf(line, sizeof(line), format, args);
+        va_end (args);
+        if (status > (int) sizeof(line)-1)
+            status = sizeof(line)-1;
+        if (status > 0)
+            sink_data(&pipe_list[pipe_num], line, status);
+        return status;
+    }
+
     if (pipe_list[pipe_num].write_fd < 0)
       return -1;
 
@@ -295,7 +445,10 @@ void write_data(pipe_buffer *bufr, char *data, int length)
     unsigned char *ptr;
     int offset;
 
-    if (bufr->write_fd >= 0) {
+    if (bufr->sink) {
+        sink_data(bufr, data, length);
+
+    } else if (bufr->write_fd >= 0) {
         write(bufr->write_fd, data, length);
 
     } else if (bufr->stream_ptr != NULL) {
@@ -315,6 +468,244 @@ void write_data(pipe_buffer *bufr, char *data, int length)
 }
 
 
+int server_publish(const char *channel, const char *line, int length);
+int socket_publish(int pipe_num, const char *channel, const char *line, int length);
+void stop_fifo_server();
+
+/* Set current channel name of pipe from "channel: name" directive line (no colons/spaces allowed in name) */
+void set_channel_name(pipe_buffer *bufr, const char *line, int length)
+{
+    int i, j, end;
+
+    for (i=8; i < length && line[i] == ' '; i++) ;
+    for (end=length; end > i && (line[end-1] == ' ' || line[end-1] == '\r' || line[end-1] == '\n'); end--) ;
+    for (j=0; i < end && j < FIFO_NAMEMAX-1; i++)
+        bufr->channel[j++] = (line[i] == ':' || line[i] == ' ') ? '_' : line[i];
+    bufr->channel[j] = '\0';
+}
+
+/* Process complete line written to a sink pipe.
+   Channel directive lines ("channel: name") switch the current channel (as in fifofum.py --multiplex=1)
+*/
+void sink_line(pipe_buffer *bufr, char *line, int length)
+{
+    if (length >= 8 && strncmp(line, "channel:", 8) == 0) {
+        set_channel_name(bufr, line, length);
+        return;
+    }
+
+    if (bufr->sink == SERVER_SINK)
+        server_publish(bufr->channel, line, length);
+    else if (bufr->sink == SOCKET_SINK)
+        socket_publish(bufr->pipe_num, bufr->channel, line, length);
+}
+
+
+/* Ensure that frame buffer has room for length more bytes, returning 0 on success, or -1 on error */
+int frame_reserve(pipe_buffer *bufr, int length)
+{
+    int maxlen;
+    char *buf;
+
+    if (bufr->frame_len + length <= bufr->frame_maxlen)
+        return 0;
+
+    maxlen = 2*(bufr->frame_len + length) + FIFO_LINEMAX;
+    buf = realloc(bufr->frame_buf, maxlen);
+    if (buf == NULL) {
+        fprintf(stderr, "FIFO:frame_reserve: Failed to allocate frame buffer for pipe %d\n", bufr->pipe_num);
+        bufr->frame_len = 0;
+        return -1;
+    }
+    bufr->frame_buf = buf;
+    bufr->frame_maxlen = maxlen;
+    return 0;
+}
+
+
+/* Append data to frame of file sink pipe (frames are published by end_frame) */
+void frame_append(pipe_buffer *bufr, const char *data, int length)
+{
+    struct mmap_header *header;
+    char *slot;
+
+    if (bufr->sink == MMAP_SINK) {
+        /* Write directly into the inactive slot (overflow is detected by end_frame) */
+        header = (struct mmap_header *) bufr->mmap_ptr;
+        slot = bufr->mmap_ptr + FIFO_MMAP_HDRLEN + (1-header->active)*header->slot_size;
+        if (bufr->frame_len + length <= (int) header->slot_size)
+            memcpy(slot+bufr->frame_len, data, length);
+        bufr->frame_len += length;
+        return;
+    }
+
+    if (frame_reserve(bufr, length) < 0)
+        return;
+    memcpy(bufr->frame_buf+bufr->frame_len, data, length);
+    bufr->frame_len += length;
+}
+
+
+/* Append data to line assembly buffer of sink pipe, processing each complete line */
+void sink_data(pipe_buffer *bufr, const char *data, int length)
+{
+    const char *eol;
+    int n;
+
+    if (bufr->sink == FILE_SINK || bufr->sink == MMAP_SINK) {
+        frame_append(bufr, data, length);
+        return;
+    }
+
+    while (length > 0) {
+        eol = memchr(data, '\n', length);
+        n = eol ? (int)(eol - data) : length;
+
+        if (frame_reserve(bufr, n) < 0)
+            return;
+        memcpy(bufr->frame_buf+bufr->frame_len, data, n);
+        bufr->frame_len += n;
+
+        if (!eol)
+            break;
+
+        sink_line(bufr, bufr->frame_buf, bufr->frame_len);
+        bufr->frame_len = 0;
+        data += n+1;
+        length -= n+1;
+    }
+}
+
+
+/* Fortran-callable function that publishes the frame accumulated by a latest-frame file/mmap pipe.
+(Called automatically after each image is encoded; no-op for other pipes)
+A file frame is written in large chunks to path.tmp, and then atomically renamed to path,
+so that readers never see a partially written frame.
+Returns 0 on success, or -1 on error.
+*/
+int end_frame(int pipe_num)
+{
+    pipe_buffer *bufr;
+    struct mmap_header *header;
+    char tmp_path[FIFO_PATHMAX+8];
+    int fd, offset, count, status;
+
+    if (!check_pipe_num(pipe_num))
+        return -1;
+
+    bufr = &pipe_list[pipe_num];
+
+    if (bufr->sink == MMAP_SINK) {
+        header = (struct mmap_header *) bufr->mmap_ptr;
+        if (bufr->frame_len > (int) header->slot_size) {
+            fprintf(stderr, "FIFO:end_frame: Frame of %d bytes exceeds mmap slot size %d; dropped\n", bufr->frame_len, header->slot_size);
+            bufr->frame_len = 0;
+            return -1;
+        }
+        /* Publish inactive slot: readers retry if seq changes while they are copying */
+        header->len[1-header->active] = bufr->frame_len;
+        __sync_synchronize();
+        header->active = 1 - header->active;
+        __sync_synchronize();
+        header->seq++;
+        bufr->frame_len = 0;
+        if (bufr->fsync)
+            msync(bufr->mmap_ptr, bufr->mmap_len, MS_ASYNC);
+        return 0;
+    }
+
+    if (bufr->sink != FILE_SINK)
+        return 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bufr->path);
+    fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd < 0) {
+        perror("FIFO:end_frame: Failed to open temporary file");
+        bufr->frame_len = 0;
+        return -1;
+    }
+
+    status = 0;
+    for (offset = 0; offset < bufr->frame_len; offset += count) {
+        count = write(fd, bufr->frame_buf+offset, bufr->frame_len-offset);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                count = 0;
+                continue;
+            }
+            perror("FIFO:end_frame: Failed to write temporary file");
+            status = -1;
+            break;
+        }
+    }
+    bufr->frame_len = 0;
+
+    if (status == 0 && bufr->fsync)
+        fsync(fd);
+    close(fd);
+
+    if (status == 0 && rename(tmp_path, bufr->path) < 0) {
+        perror("FIFO:end_frame: Failed to rename temporary file");
+        status = -1;
+    }
+    if (status < 0)
+        unlink(tmp_path);
+
+    return status;
+}
+
+
+/* Frame tracing */
+
+static long long trace_clock()
+{
+    /* CLOCK_MONOTONIC time in microseconds (same clock as fifofum.py --trace) */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000LL*ts.tv_sec + ts.tv_nsec/1000;
+}
+
+/* Fortran-callable function that enables (enable != 0) or disables tracing of image frames (also enabled by
+setting the environment variable FIFO_TRACE=1). Each image written to a data URL pipe is then followed by
+a directive line "trace:seq start encoded written\n", with the CLOCK_MONOTONIC times in microseconds when
+the frame was started, when the image was encoded, and when its last byte was written.
+Base64 output is written while the image is being encoded (PNG compression passes each block on as it is
+produced), so "encoded" is when all of the image data has been passed to the pipe, and "written" is after
+the final flush, for both PNG and raw (-DFIFO_NO_PNG) images.
+fifofum.py --trace=file.json combines these with its own and browser timings into a Chrome trace file.
+*/
+void set_fifo_trace(int enable)
+{
+    check_pipe_num(0);  /* Initialize first (FIFO_TRACE only sets the default) */
+    trace_enabled = (enable != 0);
+}
+
+/* Fortran-callable function that marks the start of the next frame of a pipe being traced, e.g.,
+before quantizing the data (encode_image, encode_field16 mark the start, if not already marked)
+*/
+void trace_frame_start(int pipe_num)
+{
+    if (!trace_enabled || !check_pipe_num(pipe_num))
+        return;
+
+    if (!pipe_list[pipe_num].trace_start)
+        pipe_list[pipe_num].trace_start = trace_clock();
+}
+
+/* Write trace directive line for frame encoded at time encoded (before the frame is ended) */
+static void trace_frame_end(int pipe_num, long long encoded)
+{
+    pipe_buffer *bufr = &pipe_list[pipe_num];
+    long long start = bufr->trace_start;
+
+    bufr->trace_start = 0;
+    if (!start || bufr->encoding != DATA_URL_ENC || bufr->sink == SERVER_SINK || (!bufr->sink && bufr->write_fd < 0))
+        return;  /* Only fifofum.py reads trace lines */
+
+    write_to_pipe_formatted(pipe_num, "trace:%d %lld %lld %lld\n", ++bufr->trace_seq, start, encoded, trace_clock());
+}
+
+
 /* Specify str = NULL and length = 0 to force flushing of buffer */
 
 void append_to_line(pipe_buffer *bufr, char *str, int length)
@@ -352,6 +743,25 @@ static char b64_encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
 
 static int b64_mod_table[] = {0, 2, 1};
 
+/* Base64 encode length bytes to null-terminated string out (of size >= 4*((length+2)/3)+1) */
+static void b64_string(const unsigned char *data, int length, char *out)
+{
+    int i, j;
+    uint32_t triple;
+
+    for (i = 0, j = 0; i < length; i += 3) {
+        triple = (uint32_t)data[i] << 16;
+        if (i+1 < length) triple |= (uint32_t)data[i+1] << 8;
+        if (i+2 < length) triple |= data[i+2];
+        out[j++] = b64_encoding_table[(triple >> 18) & 0x3F];
+        out[j++] = b64_encoding_table[(triple >> 12) & 0x3F];
+        out[j++] = (i+1 < length) ? b64_encoding_table[(triple >> 6) & 0x3F] : '=';
+        out[j++] = (i+2 < length) ? b64_encoding_table[triple & 0x3F] : '=';
+    }
+    out[j] = '\0';
+}
+
+
 /* Write encoded data to buffer/file */
 void write_encoded(int pipe_num, char *data, int length)
 {
@@ -463,7 +873,7 @@ int open_write_fd(const char *path, int named_pipe)
 #endif
 
     if (!named_pipe) {
-        write_fd = open(path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+        write_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
         if (write_fd < 0) {
 	    perror("FIFO:open_write_fd: read_fd: Failed to open file");
             return -1;
@@ -550,8 +960,23 @@ encoding may be: NO_ENC        (0)  for none (raw bytes)
                  B64_LINE_ENC  (-1) for Base64, broken into 80 character lines
                  GRAPHTERM_ENC (-2) for Base64 with GraphTerm prefix and suffix
 If named_pipe, a FIFO file is opened (if needed) and kept open even after data is output.
+Otherwise, the file always contains the latest complete frame (image plus any preceding text),
+published by writing to path.tmp and renaming (see end_frame and set_pipe_fsync).
 */
 
+/* Name channel of pipe after file basename, without extension (as in fifofum.py) */
+void set_pipe_name(int pipe_num, const char *path)
+{
+    const char *name, *ext;
+    char line[FIFO_NAMEMAX+8];
+
+    name = strrchr(path, '/');
+    name = name ? name+1 : path;
+    ext = strrchr(name, '.');
+    snprintf(line, sizeof(line), "channel:%.*s", ext && ext != name ? (int)(ext-name) : (int) strlen(name), name);
+    set_channel_name(&pipe_list[pipe_num], line, strlen(line));
+}
+
 int allocate_file_pipe(const char *path, int encoding, int named_pipe)
 {
   int write_fd, pipe_num, keep_open;
@@ -559,6 +984,29 @@ int allocate_file_pipe(const char *path, int encoding, int named_pipe)
     if (path && strlen(path) == 1 && path[0] == '-') {
         write_fd = 1; /* stdout */
         keep_open = 1;
+    } else if (!named_pipe) {
+        /* Latest-frame file sink */
+        if (!path || strlen(path) >= FIFO_PATHMAX) {
+            fprintf(stderr, "FIFO:allocate_file_pipe: Invalid path\n");
+            return -1;
+        }
+        write_fd = open_write_fd(path, 0);  /* Check that file is writable */
+        if (write_fd < 0)
+            return write_fd;
+        close(write_fd);
+
+        pipe_num = get_available_pipe();
+        if (pipe_num < 0)
+            return pipe_num;
+
+        pipe_list[pipe_num].sink = FILE_SINK;
+        pipe_list[pipe_num].encoding = encoding;
+        pipe_list[pipe_num].path = strdup(path);
+        set_pipe_name(pipe_num, path);
+#ifdef DEBUG_FIFO
+        fprintf(stderr, "FIFO:allocate_file_pipe: latest-frame file %s, %d\n", path, pipe_num);
+#endif
+        return pipe_num;
     } else {
         write_fd = open_write_fd(path, named_pipe);
 	keep_open = named_pipe;
@@ -566,6 +1014,8 @@ int allocate_file_pipe(const char *path, int encoding, int named_pipe)
 
     if (write_fd >= 0) {
         pipe_num = allocate_pipe(write_fd, encoding, keep_open);
+        if (pipe_num >= 0 && write_fd != 1)
+            set_pipe_name(pipe_num, path);
     } else {
       pipe_num = write_fd;
     }
@@ -575,6 +1025,297 @@ int allocate_file_pipe(const char *path, int encoding, int named_pipe)
     return pipe_num;
 }
 
+
+/* Fortran-callable function that creates a double-buffered memory-mapped file for local readers polling at high rates,
+returning pipe number (>= 0) on success or negative value on error.
+The file contains a 64-byte header (magic "FIFOMMAP", uint32 version, uint32 slot_size, uint64 seq,
+uint32 active, uint32 len[2]), followed by two frame slots of max_frame_bytes each.
+Each frame is written to the inactive slot, which is then made active and seq is incremented.
+Readers should copy len[active] bytes from the active slot and retry if seq changed while copying.
+Frames larger than max_frame_bytes are dropped.
+(See allocate_file_pipe for meaning of encoding parameter)
+*/
+
+int allocate_mmap_pipe(const char *path, int encoding, int max_frame_bytes)
+{
+    struct mmap_header *header;
+    char *ptr;
+    int fd, pipe_num, mmap_len;
+
+    if (max_frame_bytes <= 0 || max_frame_bytes > (INT_MAX-FIFO_MMAP_HDRLEN)/2) {
+        fprintf(stderr, "FIFO:allocate_mmap_pipe: Invalid max_frame_bytes %d\n", max_frame_bytes);
+        return -1;
+    }
+
+    pipe_num = get_available_pipe();
+    if (pipe_num < 0)
+        return pipe_num;
+
+    mmap_len = FIFO_MMAP_HDRLEN + 2*max_frame_bytes;
+
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd < 0) {
+        perror("FIFO:allocate_mmap_pipe: Failed to open file");
+        return -1;
+    }
+    if (ftruncate(fd, mmap_len) < 0) {
+        perror("FIFO:allocate_mmap_pipe: Failed to resize file");
+        close(fd);
+        return -1;
+    }
+
+    ptr = mmap(NULL, mmap_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        perror("FIFO:allocate_mmap_pipe: Failed to map file");
+        return -1;
+    }
+
+    header = (struct mmap_header *) ptr;
+    header->version = 1;
+    header->slot_size = max_frame_bytes;
+    header->seq = 0;
+    header->active = 0;
+    header->len[0] = 0;
+    header->len[1] = 0;
+    __sync_synchronize();
+    memcpy(header->magic, FIFO_MMAP_MAGIC, 8);  /* Mark as initialized */
+
+    pipe_list[pipe_num].sink = MMAP_SINK;
+    pipe_list[pipe_num].encoding = encoding;
+    pipe_list[pipe_num].mmap_ptr = ptr;
+    pipe_list[pipe_num].mmap_len = mmap_len;
+    set_pipe_name(pipe_num, path);
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:allocate_mmap_pipe: %s, %d, %d\n", path, max_frame_bytes, pipe_num);
+#endif
+    return pipe_num;
+}
+
+/* Channel subscriptions
+
+   Viewers (fifofum.py, or the embedded server) send a control line of the form
+       fifo:subscribe *=0x0 name1=640x480 name2=- ...
+   listing the channels open in any browser tab, with the requested resolution (0x0 for any),
+   or "-" for channels that are not being viewed. "*" gives the default for channels not listed.
+   Images for channels without subscribers are not encoded (see pipe_subscribed).
+   Each viewer only controls the pipes it reads: lines received by update_subscriptions apply to pipes
+   written to file descriptors (named pipes or stdout), and those of the embedded server to server pipes.
+   Until the first line for its scope is received, and for other sinks (files, sockets), all channels are encoded.
+   The tables may be updated by another thread (server, command reader), and are protected by a mutex.
+*/
+
+#define FIFO_MAX_SUBS 64
+
+#define SUB_INPUT  0   /* subscriptions received by update_subscriptions */
+#define SUB_SERVER 1   /* subscriptions of embedded server clients */
+
+typedef struct {
+    char name[FIFO_NAMEMAX];
+    int width;                       /*  requested resolution (0 for any, -1 if unsubscribed) */
+    int height;
+} fifo_sub;
+
+static fifo_sub sub_tables[2][FIFO_MAX_SUBS+1];  /* last entry is default ("*") */
+static int sub_counts[2] = {-1, -1};             /* -1 until first subscription line */
+
+#ifdef FIFO_THREADS
+static pthread_mutex_t sub_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define SUB_LOCK()   pthread_mutex_lock(&sub_mutex)
+#define SUB_UNLOCK() pthread_mutex_unlock(&sub_mutex)
+#else
+#define SUB_LOCK()
+#define SUB_UNLOCK()
+#endif
+
+/* Parse subscription tokens into table (with default as last entry), returning number of entries */
+int parse_subscriptions(const char *line, fifo_sub *table, int max_subs)
+{
+    int n, length;
+    const char *token, *eq;
+    fifo_sub sub;
+
+    table[max_subs].width = 0;
+    table[max_subs].height = 0;
+
+    n = 0;
+    for (token = line; *token; token += length) {
+        for (; *token == ' ' || *token == '\t'; token++) ;
+        length = strcspn(token, " \t\r\n");
+        if (!length)
+            break;
+
+        eq = memchr(token, '=', length);
+        if (!eq || eq == token || eq-token >= FIFO_NAMEMAX)
+            continue;
+        snprintf(sub.name, FIFO_NAMEMAX, "%.*s", (int)(eq-token), token);
+        if (eq[1] == '-' || sscanf(eq+1, "%dx%d", &sub.width, &sub.height) != 2) {
+            sub.width = -1;
+            sub.height = -1;
+        }
+
+        if (strcmp(sub.name, "*") == 0)
+            table[max_subs] = sub;
+        else if (n < max_subs)
+            table[n++] = sub;
+    }
+    return n;
+}
+
+
+/* Replace subscription table of scope with the tokens of a "fifo:subscribe ..." line */
+static void store_subscriptions(int scope, const char *line)
+{
+    fifo_sub table[FIFO_MAX_SUBS+1];
+    int n;
+
+    n = parse_subscriptions(line+14, table, FIFO_MAX_SUBS);
+
+    SUB_LOCK();
+    memcpy(sub_tables[scope], table, n*sizeof(fifo_sub));
+    sub_tables[scope][FIFO_MAX_SUBS] = table[FIFO_MAX_SUBS];
+    sub_counts[scope] = n;
+    SUB_UNLOCK();
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:store_subscriptions: %d, %d entries\n", scope, n);
+#endif
+}
+
+/* Fortran-callable function that processes a "fifo:subscribe ..." control line (received via the input pipe),
+for pipes written to file descriptors. Returns 1 if line was a subscription line, or 0 otherwise.
+*/
+int update_subscriptions(const char *line)
+{
+    if (strncmp(line, "fifo:subscribe", 14) != 0)
+        return 0;
+
+    store_subscriptions(SUB_INPUT, line);
+    return 1;
+}
+
+
+/* Fortran-callable function that checks whether the current channel of pipe has any subscribers,
+returning 1 if it does (or no subscriptions have been received), or 0 otherwise.
+The largest requested resolution is returned in *width, *height (0 for any).
+*/
+int pipe_subscribed(int pipe_num, int *width, int *height)
+{
+    int i, scope, subscribed;
+    fifo_sub *table, *sub;
+
+    *width = 0;
+    *height = 0;
+
+    if (!check_pipe_num(pipe_num))
+        return 0;
+
+    if (pipe_list[pipe_num].sink == SERVER_SINK)
+        scope = SUB_SERVER;
+    else if (!pipe_list[pipe_num].sink && pipe_list[pipe_num].write_fd >= 0)
+        scope = SUB_INPUT;
+    else
+        return 1;  /* Files, sockets and buffers may have other readers */
+
+    SUB_LOCK();
+    subscribed = 1;
+    if (sub_counts[scope] >= 0) {
+        table = sub_tables[scope];
+        sub = &table[FIFO_MAX_SUBS];
+        for (i = 0; i < sub_counts[scope]; i++) {
+            if (strcmp(table[i].name, pipe_list[pipe_num].channel) == 0) {
+                sub = &table[i];
+                break;
+            }
+        }
+        subscribed = (sub->width >= 0);
+        if (subscribed) {
+            *width = sub->width;
+            *height = sub->height;
+        }
+    }
+    SUB_UNLOCK();
+
+    return subscribed;
+}
+
+
+/* Fortran-callable function that writes a tile directive line, announcing that the next image written to the pipe
+is the tile of size width x height at offset (x_offset, y_offset) (0-based) within a global image of size
+global_width x global_height. This allows each MPI rank to encode only its own subdomain, with fifofum.py stitching
+the tiles with the same name and sequence number (from any number of pipes) into a single image for the name channel.
+If seq < 0, a per-pipe counter is used (ranks that plot at the same time steps stay in step).
+Returns number of bytes written, or -1 on error.
+*/
+
+int write_tile_header(int pipe_num, const char *name, int seq, int x_offset, int y_offset, int width, int height,
+                      int global_width, int global_height)
+{
+    if (!check_pipe_num(pipe_num))
+        return -1;
+
+    if (seq < 0)
+        seq = ++pipe_list[pipe_num].tile_seq;
+    else
+        pipe_list[pipe_num].tile_seq = seq;
+    pipe_list[pipe_num].tile_pending = 1;
+
+    return write_to_pipe_formatted(pipe_num, "tile:%s %d %d %d %d %d %d %d\n", (name && name[0]) ? name : "tiles",
+                                   seq, x_offset, y_offset, width, height, global_width, global_height);
+}
+
+/* Fortran-callable function that appends count samples (t[i], values[i]) to the time series name,
+writing them as a compact directive line "series:name base64\n", where base64 encodes (t, value) pairs
+of little-endian IEEE doubles (at most FIFO_SERIES_BATCH samples per line).
+fifofum.py keeps the whole history of each series, decimated for plotting in the browser.
+Returns number of bytes written, or -1 on error.
+*/
+
+#define FIFO_SERIES_BATCH 64
+
+int write_series(int pipe_num, const char *name, int count, const double *t, const double *values)
+{
+    unsigned char raw[FIFO_SERIES_BATCH*16];
+    char line[FIFO_NAMEMAX + 4*(FIFO_SERIES_BATCH*16+2)/3 + 16];
+    uint64_t bits;
+    int i, j, k, n, offset, status, total;
+
+    if (!check_pipe_num(pipe_num))
+        return -1;
+
+    if (!name || !name[0] || strlen(name) >= FIFO_NAMEMAX || strpbrk(name, ": \n")) {
+        fprintf(stderr, "FIFO:write_series: Invalid series name\n");
+        return -1;
+    }
+
+    total = 0;
+    for (i = 0; i < count; i += n) {
+        n = (count - i < FIFO_SERIES_BATCH) ? count - i : FIFO_SERIES_BATCH;
+        for (j = 0; j < n; j++) {
+            memcpy(&bits, t+i+j, 8);
+            for (k = 0; k < 8; k++)
+                raw[16*j+k] = (bits >> (8*k)) & 0xff;
+            memcpy(&bits, values+i+j, 8);
+            for (k = 0; k < 8; k++)
+                raw[16*j+8+k] = (bits >> (8*k)) & 0xff;
+        }
+
+        offset = sprintf(line, "series:%s ", name);
+        b64_string(raw, 16*n, line+offset);
+        offset += strlen(line+offset);
+        line[offset++] = '\n';
+
+        status = write_to_pipe(pipe_num, line, offset);
+        if (status < 0)
+            return -1;
+        total += status;
+    }
+
+    return total;
+}
+
+
 #ifndef FIFO_NO_PNG
 #include <png.h>
 
@@ -606,6 +1347,8 @@ img is a char(height, width) array with 0-255 colormap index values.
 colors is a int(palette_size,3) array containing 0-255 RGB colormap triplets.
 alphas is a int(n_alphas) array containing 0-255 alpha values (0=>transparent, 255=>opaque)
 n_alphas must be <= 255, but is typically 0 or 1 for no or single transparent color.
+Only the colors actually used are written to the PNG palette (and transparency) chunks.
+If 16 or fewer colors are used, they are remapped to a 1/2/4-bit palette, with non-opaque colors first.
 Return number of characters converted on success, or negative value on error.
 */
 
@@ -615,14 +1358,31 @@ int encode_image(int pipe_num, char *img, int width, int height, int reverse, in
     char width_height[4];
     char rgba[4*256];
     int p, x, y, offset3, offset4;
+    long long encoded;
 
     int count = -1;
     int pixel_size = 1;
     int depth = 8;
+    int step = 1;
+    int req_width, req_height;
 
     if (!check_pipe_num(pipe_num))
       return -1;
 
+    if (pipe_list[pipe_num].tile_pending) {
+        pipe_list[pipe_num].tile_pending = 0;  /* Tiles are always encoded at full resolution */
+    } else if (!pipe_subscribed(pipe_num, &req_width, &req_height)) {
+        pipe_list[pipe_num].trace_start = 0;
+        return 0;  /* No subscribers */
+    } else if (req_width > 0 && req_height > 0) {
+        /* Downsample (PNG only) by largest integer factor that still provides the requested resolution */
+        step = (width/req_width < height/req_height) ? width/req_width : height/req_height;
+        if (step < 1)
+            step = 1;
+    }
+
+    trace_frame_start(pipe_num);
+
     for (p = 0; p < palette_size; p++) {
         offset3 = reverse ? 3*(palette_size-1-p) : 3*p;
 	offset4 = 4*p;
@@ -656,8 +1416,11 @@ int encode_image(int pipe_num, char *img, int width, int height, int reverse, in
 	write_encoded(pipe_num, rgba, 4*256);
 	write_encoded(pipe_num, img, width*height);
 	write_encoded(pipe_num, "", 0);
+        encoded = pipe_list[pipe_num].trace_start ? trace_clock() : 0;  /* As for PNG, after Base64 output */
         write_to_pipe_formatted(pipe_num, "\n");
 	flush_pipe(pipe_num);
+        trace_frame_end(pipe_num, encoded);
+	end_frame(pipe_num);
         return 0;
     }
 
@@ -666,162 +1429,2667 @@ int encode_image(int pipe_num, char *img, int width, int height, int reverse, in
     png_infop info_ptr = NULL;
     png_bytep row = NULL;
     png_bytep trans_color = NULL;
+    int n_used, max_used, n_trans;
+    unsigned char used[256], remap[256], order[256], opacity[256];
+    int stride = width*step;  /* offset between sampled rows of img */
+
+    width /= step;
+    height /= step;
 
     if (pipe_list[pipe_num].encoding == DATA_URL_ENC)
       write_to_pipe_formatted(pipe_num, DATA_URL_PREFIX_FMT, IMAGE_TYPE);
     if (pipe_list[pipe_num].encoding == GRAPHTERM_ENC)
         write_to_pipe_formatted(pipe_num, GRAPHTERM_PREFIX_FMT, IMAGE_TYPE);
-    
-    /* File info */
-    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png_ptr == NULL) {
-        goto png_create_write_struct_failed;
+
+    /* Find colors actually used */
+    memset(used, 0, sizeof(used));
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++)
+            used[(unsigned char) img[x*step+stride*y]] = 1;
+    }
+
+    n_used = 0;
+    max_used = 0;
+    for (p = 0; p < 256; p++) {
+        opacity[p] = (p < n_alphas) ? (unsigned char) rgba[3+4*p] : 255;
+        if (used[p]) {
+            n_used++;
+            max_used = p;
+        }
+    }
+    if (!n_used) {
+        used[0] = 1;
+        n_used = 1;
+    }
+
+    if (n_used <= 16) {
+        /* Remap to packed palette, with non-opaque colors first (to trim transparency chunk) */
+        n_trans = 0;
+        for (p = 0; p < 256; p++) {
+            if (used[p] && opacity[p] != 255)
+                order[n_trans++] = p;
+        }
+        palette_size = n_trans;
+        for (p = 0; p < 256; p++) {
+            if (used[p] && opacity[p] == 255)
+                order[palette_size++] = p;
+        }
+        for (p = 0; p < palette_size; p++)
+            remap[order[p]] = p;
+
+        if (palette_size <= 2)
+            depth = 1;
+        else if (palette_size <= 4)
+            depth = 2;
+        else
+            depth = 4;
+
+    } else {
+        /* Trim palette after last color used, and transparency chunk after last non-opaque color */
+        palette_size = max_used+1;
+        n_trans = 0;
+        for (p = 0; p < palette_size; p++) {
+            order[p] = p;
+            remap[p] = p;
+            if (opacity[p] != 255)
+                n_trans = p+1;
+        }
+    }
+
+    /* File info */
+    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        goto png_create_write_struct_failed;
+    }
+
+    /* Image info */
+    info_ptr = png_create_info_struct (png_ptr);
+    if (info_ptr == NULL) {
+        goto png_create_info_struct_failed;
+    }
+
+    /* Set up error handling. */
+    if (setjmp( png_jmpbuf(png_ptr) )) {
+        goto png_failure;
+    }
+
+    /* Set image attributes. */
+    png_set_IHDR (png_ptr,
+                  info_ptr,
+                  width,
+                  height,
+                  depth,
+                  PNG_COLOR_TYPE_PALETTE,
+                  PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_DEFAULT,
+                  PNG_FILTER_TYPE_DEFAULT);
+
+    png_color* palette = (png_color*) png_malloc(png_ptr, palette_size*sizeof(png_color));
+
+
+    for (p = 0; p < palette_size; p++) {
+        offset4 = 4*order[p];
+	png_color* pcol = &palette[p];
+        pcol->red   = rgba[0+offset4];
+        pcol->green = rgba[1+offset4];
+        pcol->blue  = rgba[2+offset4];
+	/* fprintf(stderr, "COL=%d, offset4=%d: RGB (%d, %d, %d)\n", p, offset4, pcol->red, pcol->green, pcol->blue); */
+    }
+
+    png_set_PLTE(png_ptr, info_ptr, palette, palette_size);
+
+    if (n_trans > 0) {
+        /* Set up transparency block, starting from color index 0 */
+        trans_color = (png_bytep) png_malloc(png_ptr, n_trans * sizeof(png_byte));
+	for (p = 0; p < n_trans; p++) {
+	  trans_color[p] = opacity[order[p]];
+	  /* fprintf(stderr, "ALPHA p=%d, alpha=%d\n", p, trans_color[p]); */ 
+	}
+	png_set_tRNS(png_ptr, info_ptr, (png_voidp) trans_color, n_trans, NULL);
+    }
+  
+    png_set_write_fn(png_ptr, (png_voidp) &pipe_list[pipe_num], (png_rw_ptr) write_file,
+                    (png_flush_ptr) flush_file);
+
+    png_write_info(png_ptr, info_ptr);
+
+    if (depth < 8)
+        png_set_packing(png_ptr);  /* Pack one index per byte into depth bits */
+
+    /* Start writing image data */
+    row = (png_bytep) png_malloc(png_ptr, pixel_size * width * sizeof(png_byte));
+
+    for (y=0 ; y<height ; y++) {
+        for (x=0 ; x<width ; x++) {
+            row[x] = remap[(unsigned char) img[x*step+stride*y]];
+	    /* fprintf(stderr, "IMG(%d,%d) = %d\n", y, x, row[x]); */
+        }
+        png_write_row(png_ptr, row);
+    }
+
+    /* End write */
+    png_write_end(png_ptr, NULL);
+    encoded = pipe_list[pipe_num].trace_start ? trace_clock() : 0;
+
+    write_file(png_ptr, NULL, 0); /* Finalize */
+    flush_pipe(pipe_num);
+
+    png_free(png_ptr, row);
+
+    if (pipe_list[pipe_num].encoding == DATA_URL_ENC)
+        write_to_pipe_formatted(pipe_num, DATA_URL_SUFFIX);
+    if (pipe_list[pipe_num].encoding == GRAPHTERM_ENC)
+        write_to_pipe_formatted(pipe_num, GRAPHTERM_SUFFIX);
+
+    trace_frame_end(pipe_num, encoded);
+    end_frame(pipe_num);
+
+    if (pipe_list[pipe_num].stream_ptr) {
+        if (pipe_list[pipe_num].stream_len <= pipe_list[pipe_num].stream_maxlen) {
+	    count = pipe_list[pipe_num].stream_len; /* success! */
+	} else {
+	    count = -pipe_list[pipe_num].stream_len; /* buffer too small */
+	}
+    } else {
+      count = 0;
+    }
+
+ png_failure:
+ png_create_info_struct_failed:
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+ png_create_write_struct_failed:
+ /* End of FIFO_NO_PNG */
+#endif
+    if (count < 0 && (pipe_list[pipe_num].sink == FILE_SINK || pipe_list[pipe_num].sink == MMAP_SINK))
+        pipe_list[pipe_num].frame_len = 0;  /* Discard incomplete frame */
+    pipe_list[pipe_num].trace_start = 0;
+    return count;
+}
+
+/* Fortran-callable function that writes a real(width,height) data field (elem_size 4 for float, 8 for double),
+quantized to 16 bits, as an RGB PNG image with red = high byte and green = low byte of the quantized value q
+(0 for NaN values, or values equal to undef_value if check_undef is non-zero; 1-65535 otherwise).
+The data value is offset + scale*(q-1), with the data URL of the form
+"data:image/png;field16offset=offset;field16scale=scale;base64,...",
+so that the browser can apply the colormap, range and opacity, and display values under the pointer, without re-encoding.
+min_value/max_value that are NaN are determined from the data (values outside the range are clipped).
+Tiles are not supported. Returns the same values as encode_image.
+*/
+int encode_field16(int pipe_num, const void *data, int elem_size, int width, int height,
+                   double min_value, double max_value, int check_undef, double undef_value)
+{
+    int count = -1;
+
+#ifdef FIFO_NO_PNG
+    fprintf(stderr, "FIFO:encode_field16: Not available (compile without -DFIFO_NO_PNG)\n");
+#else
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_bytep row = NULL;
+    int x, y, k, q, found;
+    int step = 1;
+    int req_width, req_height, stride;
+    double value, fmin, fmax, scale;
+    long long encoded;
+
+    if (!check_pipe_num(pipe_num))
+        return -1;
+
+    if (elem_size != sizeof(float) && elem_size != sizeof(double)) {
+        fprintf(stderr, "FIFO:encode_field16: Invalid element size %d\n", elem_size);
+        return -1;
+    }
+
+    pipe_list[pipe_num].tile_pending = 0;
+    if (!pipe_subscribed(pipe_num, &req_width, &req_height)) {
+        pipe_list[pipe_num].trace_start = 0;
+        return 0;  /* No subscribers */
+    } else if (req_width > 0 && req_height > 0) {
+        step = (width/req_width < height/req_height) ? width/req_width : height/req_height;
+        if (step < 1)
+            step = 1;
+    }
+    stride = width*step;
+    width /= step;
+    height /= step;
+    trace_frame_start(pipe_num);
+
+#define FIELD16_VALUE(k) ((elem_size == sizeof(float)) ? ((const float *) data)[k] : ((const double *) data)[k])
+#define FIELD16_UNDEF(v) ((v) != (v) || (check_undef && (v) == undef_value))
+
+    if (min_value != min_value || max_value != max_value) {
+        fmin = 0.0;
+        fmax = 0.0;
+        found = 0;
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                value = FIELD16_VALUE(x*step+stride*y);
+                if (FIELD16_UNDEF(value))
+                    continue;
+                if (!found || value < fmin)
+                    fmin = value;
+                if (!found || value > fmax)
+                    fmax = value;
+                found = 1;
+            }
+        }
+        if (min_value != min_value)
+            min_value = fmin;
+        if (max_value != max_value)
+            max_value = fmax;
+    }
+    scale = (max_value > min_value) ? (max_value-min_value)/65534.0 : 0.0;
+
+    if (pipe_list[pipe_num].encoding == DATA_URL_ENC)
+        write_to_pipe_formatted(pipe_num, "data:image/png;field16offset=%.9g;field16scale=%.9g;base64,", min_value, scale);
+    if (pipe_list[pipe_num].encoding == GRAPHTERM_ENC)
+        write_to_pipe_formatted(pipe_num, GRAPHTERM_PREFIX_FMT, "png");
+
+    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        goto png_create_write_struct_failed;
+    }
+
+    info_ptr = png_create_info_struct (png_ptr);
+    if (info_ptr == NULL) {
+        goto png_create_info_struct_failed;
+    }
+
+    if (setjmp( png_jmpbuf(png_ptr) )) {
+        goto png_failure;
+    }
+
+    png_set_IHDR (png_ptr,
+                  info_ptr,
+                  width,
+                  height,
+                  8,
+                  PNG_COLOR_TYPE_RGB,
+                  PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_DEFAULT,
+                  PNG_FILTER_TYPE_DEFAULT);
+
+    png_set_write_fn(png_ptr, (png_voidp) &pipe_list[pipe_num], (png_rw_ptr) write_file,
+                    (png_flush_ptr) flush_file);
+
+    png_write_info(png_ptr, info_ptr);
+
+    row = (png_bytep) png_malloc(png_ptr, 3 * width * sizeof(png_byte));
+
+    for (y=0 ; y<height ; y++) {
+        for (x=0 ; x<width ; x++) {
+            k = x*step+stride*y;
+            value = FIELD16_VALUE(k);
+            if (FIELD16_UNDEF(value))
+                q = 0;
+            else if (scale == 0.0 || value <= min_value)
+                q = 1;
+            else if (value >= max_value)
+                q = 65535;
+            else
+                q = 1 + (int) ((value-min_value)/scale + 0.5);
+            row[3*x] = q >> 8;
+            row[3*x+1] = q & 0xff;
+            row[3*x+2] = 0;
+        }
+        png_write_row(png_ptr, row);
+    }
+
+#undef FIELD16_VALUE
+#undef FIELD16_UNDEF
+
+    png_write_end(png_ptr, NULL);
+    encoded = pipe_list[pipe_num].trace_start ? trace_clock() : 0;
+
+    write_file(png_ptr, NULL, 0); /* Finalize */
+    flush_pipe(pipe_num);
+
+    png_free(png_ptr, row);
+
+    if (pipe_list[pipe_num].encoding == DATA_URL_ENC)
+        write_to_pipe_formatted(pipe_num, DATA_URL_SUFFIX);
+    if (pipe_list[pipe_num].encoding == GRAPHTERM_ENC)
+        write_to_pipe_formatted(pipe_num, GRAPHTERM_SUFFIX);
+
+    trace_frame_end(pipe_num, encoded);
+    end_frame(pipe_num);
+
+    if (pipe_list[pipe_num].stream_ptr) {
+        if (pipe_list[pipe_num].stream_len <= pipe_list[pipe_num].stream_maxlen) {
+	    count = pipe_list[pipe_num].stream_len;
+	} else {
+	    count = -pipe_list[pipe_num].stream_len;
+	}
+    } else {
+      count = 0;
+    }
+
+ png_failure:
+ png_create_info_struct_failed:
+    png_destroy_write_struct (&png_ptr, &info_ptr);
+ png_create_write_struct_failed:
+    if (count < 0 && (pipe_list[pipe_num].sink == FILE_SINK || pipe_list[pipe_num].sink == MMAP_SINK))
+        pipe_list[pipe_num].frame_len = 0;  /* Discard incomplete frame */
+    pipe_list[pipe_num].trace_start = 0;
+ /* End of FIFO_NO_PNG */
+#endif
+    return count;
+}
+
+/* Create and open named pipe for reading, returning file descriptor (>= 0) */
+int open_read_fd(const char *path)
+{
+    int read_fd, retval;
+    struct stat pipe_status;
+ 
+    if (access(path, F_OK) != 0) {
+        retval = mkfifo(path, S_IRUSR|S_IWUSR);
+	if (retval < 0) {
+	    perror("FIFO:open_read_fd: Failed to create new named pipe (FIFO)");
+	    return -1;
+	}
+    }
+
+    read_fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (read_fd < 0) {
+      perror("FIFO:open_read_fd: Failed to open pipe for reading");
+      return -1;
+    }
+    
+    if (fstat(read_fd, &pipe_status) < 0) {
+        perror("FIFO:open_read_fd: Failed fstat");
+	close(read_fd);
+	return -1;
+    }
+
+    if (!S_ISFIFO(pipe_status.st_mode)) {
+        fprintf(stderr, "FIFO:open_read_fd: %s in not a named pipe! Remove it.\n", path);
+	close(read_fd);
+	return -1;
+    }
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:open_read_fd: %d %s\n", read_fd, path);
+#endif
+    return read_fd;
+}
+
+/* Read upto count bytes from fd, returning number of bytes read, or -1 */
+int read_from_fd(int fd, char *buf, int count)
+{
+  return read(fd, buf, count);
+}
+
+/* Colormapped quantization of real data fields (as in fifo_plot2d of fifo_f.f90)
+
+   Fields are mapped to the 240 colormap colors following the 16 basic colors.
+   colormap_code = 0 => default (Viridis)
+                   1 => Viridis (yellow->green)
+                   2 => grayscale (black->white)
+                   3 => grayalpha (transparent black->opaque white)
+   (Negative colormap codes reverse the corresponding colormap)
+*/
+
+#define FIFO_BASIC_COLORS 16
+
+/* Fill colors (int(3,256)) and alphas (int(256)) for colormap_code and opacity (0.0-1.0),
+returning values of reverse and n_alphas arguments for encode_image */
+void field_colormap(int colormap_code, double opacity, int *colors, int *alphas, int *n_alphas, int *reverse)
+{
+    int i, c, igray;
+    int n_colors = 256-FIFO_BASIC_COLORS;
+
+    if (colormap_code == 0)
+        colormap_code = 1;
+    if (colormap_code > 3)
+        colormap_code = 3;
+    if (colormap_code < -3)
+        colormap_code = -3;
+
+    *reverse = 0;
+    if (colormap_code < 0) {
+        colormap_code = -colormap_code;
+        *reverse = 1;
+    }
+
+    memcpy(colors, VIRIDIS_PLUS_CMAP, 3*256*sizeof(int));
+    if (colormap_code >= 2) {
+        /* Grayscale/transparent-grayscale colormap */
+        for (i = FIFO_BASIC_COLORS; i < 256; i++) {
+            igray = (255*(i-FIFO_BASIC_COLORS))/(n_colors-1);
+            for (c = 0; c < 3; c++)
+                colors[c+3*i] = *reverse ? 255-igray : igray;
+        }
+    }
+
+    if (opacity < 0.0)
+        opacity = 0.0;
+
+    if (colormap_code == 3) {
+        /* Transparent grayscale */
+        *n_alphas = 256;
+        for (i = 0; i < 256; i++)
+            alphas[i] = (i < FIFO_BASIC_COLORS) ? 255 : colors[3*i];
+    } else if (opacity < 1.0) {
+        /* Transparent image */
+        *n_alphas = 256;
+        for (i = 0; i < 256; i++)
+            alphas[i] = (i < FIFO_BASIC_COLORS) ? 255 : (int) (255*opacity);
+    } else {
+        *n_alphas = 0;
+    }
+}
+
+
+#define FIFO_CLIP_SAMPLES 4096   /* values sampled to estimate percentiles */
+
+/* Returns k-th smallest of n values (0 <= k < n), partially reordering values (quickselect) */
+static double select_kth(double *values, int n, int k)
+{
+    int lo = 0, hi = n-1, i, j;
+    double pivot, tem;
+
+    while (lo < hi) {
+        pivot = values[(lo+hi)/2];
+        i = lo;
+        j = hi;
+        while (i <= j) {
+            while (values[i] < pivot)
+                i++;
+            while (values[j] > pivot)
+                j--;
+            if (i <= j) {
+                tem = values[i];
+                values[i++] = values[j];
+                values[j--] = tem;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return values[k];
+}
+
+/* Fortran-callable function that quantizes a real(width,height) data field (elem_size 4 for float, 8 for double)
+into img, a char(width,height) array of colormap indices (16-255, or 0 for NaN values, and for values equal to
+undef_value if check_undef is non-zero).
+min_value:max_value spans the colormap. If max_value <= min_value, the range is determined from the data:
+if clip_percent > 0, as the clip_percent and 100-clip_percent percentiles of (up to FIFO_CLIP_SAMPLES) values
+sampled at pseudo-random positions (to avoid aliasing with periodic structure; no sorting is needed),
+otherwise as the data minimum and maximum.
+scale_mode may be LINEAR_SCALE (0), LOG_SCALE (1; only positive values determine the range), or SYMLOG_SCALE (2;
+logarithmic beyond linthresh, and linear closer to zero; if linthresh <= 0, the default of 1/1000 of the largest
+magnitude of the range is used, e.g., set linthresh to the noise floor of the field instead). Nonlinear scales map
+values through a table of colormap breakpoints (binary search), without per-value transcendental functions.
+If levels > 1, values are quantized to that many discrete levels, evenly spaced across the colormap.
+The data minimum/maximum, and the range used, are returned via data_min, data_max, range_min, range_max (if not NULL).
+Returns 0 on success, or -1 on error.
+*/
+int quantize_field(const void *data, int elem_size, int width, int height, double min_value, double max_value,
+                   int scale_mode, double clip_percent, double linthresh, int levels, int check_undef, double undef_value,
+                   char *img, double *data_min, double *data_max, double *range_min, double *range_max)
+{
+    int j, k, n, index, found, n_sample, lo, hi, mid;
+    uint32_t seed;
+    double value, scale, fmin, fmax, fmin_pos, tmin, tmax;
+    double sample[FIFO_CLIP_SAMPLES];
+    double breaks[256];
+    unsigned char level_index[256];
+    int n_colors = 256-FIFO_BASIC_COLORS;
+
+    if (elem_size != sizeof(float) && elem_size != sizeof(double)) {
+        fprintf(stderr, "FIFO:quantize_field: Invalid element size %d\n", elem_size);
+        return -1;
+    }
+
+#define FIELD_VALUE(k) ((elem_size == sizeof(float)) ? ((const float *) data)[k] : ((const double *) data)[k])
+#define FIELD_UNDEF(v) ((v) != (v) || (check_undef && (v) == undef_value))
+
+    n = width*height;
+    fmin = 0.0;
+    fmax = 0.0;
+    fmin_pos = 0.0;
+    found = 0;
+    for (k = 0; k < n; k++) {
+        value = FIELD_VALUE(k);
+        if (FIELD_UNDEF(value))
+            continue;
+        if (!found || value < fmin)
+            fmin = value;
+        if (!found || value > fmax)
+            fmax = value;
+        found = 1;
+        if (value > 0.0 && (fmin_pos <= 0.0 || value < fmin_pos))
+            fmin_pos = value;
+    }
+
+    n_sample = 0;
+    seed = 2463534242u;
+    for (j = 0; clip_percent > 0.0 && j < FIFO_CLIP_SAMPLES && j < n; j++) {
+        if (n <= FIFO_CLIP_SAMPLES) {
+            k = j;
+        } else {
+            /* xorshift32 */
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            k = seed % n;
+        }
+        value = FIELD_VALUE(k);
+        if (FIELD_UNDEF(value) || (scale_mode == LOG_SCALE && value <= 0.0))
+            continue;
+        sample[n_sample++] = value;
+    }
+    if (data_min)
+        *data_min = fmin;
+    if (data_max)
+        *data_max = fmax;
+
+    if (max_value <= min_value) {
+        if (clip_percent > 0.0 && n_sample > 0) {
+            k = (int) (0.01*clip_percent*(n_sample-1) + 0.5);
+            if (k > (n_sample-1)/2)
+                k = (n_sample-1)/2;
+            min_value = select_kth(sample, n_sample, k);
+            max_value = select_kth(sample, n_sample, n_sample-1-k);
+        } else {
+            min_value = (scale_mode == LOG_SCALE) ? fmin_pos : fmin;
+            max_value = fmax;
+        }
+    }
+
+    if (scale_mode == LOG_SCALE) {
+        if (max_value <= 0.0)
+            max_value = 1.0;
+        if (min_value <= 0.0 || min_value >= max_value)
+            min_value = (fmin_pos > 0.0 && fmin_pos < max_value) ? fmin_pos : 1.0e-6*max_value;
+    }
+    if (range_min)
+        *range_min = min_value;
+    if (range_max)
+        *range_max = max_value;
+
+    for (k = 0; k < n_colors; k++) {
+        /* Colormap index for each level (if any), for breakpoint tables */
+        index = k;
+        if (levels > 1) {
+            index = (k*levels)/(n_colors-1);
+            if (index > levels-1)
+                index = levels-1;
+            index = (int) (index*(n_colors-1.0)/(levels-1) + 0.5);
+        }
+        level_index[k] = FIFO_BASIC_COLORS + index;
+    }
+
+    if (scale_mode == LOG_SCALE || scale_mode == SYMLOG_SCALE) {
+        /* Value breakpoints between successive colors (in transformed space, colors are evenly spaced) */
+        if (linthresh <= 0.0)
+            linthresh = 1.0e-3*((fabs(min_value) > fabs(max_value)) ? fabs(min_value) : fabs(max_value));
+        if (linthresh <= 0.0)
+            linthresh = 1.0;
+        if (scale_mode == LOG_SCALE) {
+            tmin = log10(min_value);
+            tmax = log10(max_value);
+        } else {
+            tmin = copysign(log10(1.0 + fabs(min_value)/linthresh), min_value);
+            tmax = copysign(log10(1.0 + fabs(max_value)/linthresh), max_value);
+        }
+        for (k = 1; k < n_colors; k++) {
+            value = tmin + (k-0.5)*(tmax-tmin)/(n_colors-1);
+            if (scale_mode == LOG_SCALE)
+                breaks[k-1] = pow(10.0, value);
+            else
+                breaks[k-1] = copysign(linthresh*(pow(10.0, fabs(value)) - 1.0), value);
+        }
+
+        for (k = 0; k < n; k++) {
+            value = FIELD_VALUE(k);
+            if (FIELD_UNDEF(value)) {
+                img[k] = 0;
+                continue;
+            }
+            /* Number of breakpoints <= value */
+            lo = 0;
+            hi = n_colors-1;
+            while (lo < hi) {
+                mid = (lo+hi)/2;
+                if (value >= breaks[mid])
+                    lo = mid+1;
+                else
+                    hi = mid;
+            }
+            img[k] = (char) level_index[lo];
+        }
+
+    } else {
+        scale = (max_value > min_value) ? (n_colors-1)/(max_value-min_value) : 1.0;
+
+        for (k = 0; k < n; k++) {
+            value = FIELD_VALUE(k);
+            if (FIELD_UNDEF(value)) {
+                img[k] = 0;
+                continue;
+            }
+            value = (value-min_value)*scale;
+            if (levels > 1) {
+                /* As color_index in fifo_f.f90 */
+                index = (value <= 0.0) ? 0 : (value >= n_colors-1) ? levels-1 : (int) (value*levels/(n_colors-1));
+                if (index > levels-1)
+                    index = levels-1;
+                index = (int) (index*(n_colors-1.0)/(levels-1) + 0.5);
+            } else {
+                index = (value <= 0.0) ? 0 : (value >= n_colors-1) ? n_colors-1 : (int) (value+0.5);
+            }
+            img[k] = (char) (FIFO_BASIC_COLORS+index);
+        }
+    }
+
+#undef FIELD_VALUE
+#undef FIELD_UNDEF
+
+    return 0;
+}
+
+
+/* Registered field sampler thread (-DFIFO_THREADS)
+
+   A field array is registered once (see register_field), and a background thread then snapshots,
+   quantizes and encodes it every interval seconds (wall-clock), so that the model time loop
+   needs no plot calls. If the model calls fifo_safe_point (e.g., once per time step, where the
+   registered arrays are consistent), snapshots are copied only there; otherwise the sampler
+   thread copies the arrays directly (and may see partially updated values). Safe points are
+   only waited for if one was reached since the previous sample, and for at most FIFO_SNAPSHOT_WAIT,
+   so fields keep updating (with direct copies) during phases of the model without safe points.
+   fifo_safe_point only loads a flag, unless a snapshot has been requested by the sampler.
+   Registered fields should be written to pipes not used by the model thread.
+*/
+
+#ifdef FIFO_THREADS
+#include <pthread.h>
+#include <time.h>
+
+#define FIFO_MAX_FIELDS 32
+#define FIFO_SNAPSHOT_WAIT 1.0    /* seconds to wait for safe point before copying directly */
+
+typedef struct {
+    int active;
+    int busy;                        /*  being encoded by sampler thread */
+    int pending;                     /*  snapshot to be copied at next safe point */
+    int pipe_num;
+    const void *data;
+    int elem_size;
+    int width;
+    int height;
+    char label[FIFO_LINEMAX];
+    double min_value;
+    double max_value;
+    int colormap_code;
+    int scale_mode;
+    double clip_percent;
+    double linthresh;
+    double interval;
+    double next_time;
+    char *snapshot;
+    char *img;
+} field_entry;
+
+static field_entry field_list[FIFO_MAX_FIELDS];
+static pthread_mutex_t field_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t field_cond;
+static pthread_t field_thread;
+static int field_thread_running = 0;
+static int field_stop = 0;
+static int snapshot_request = 0;     /*  accessed atomically by fifo_safe_point */
+static int safe_point_seen = 0;      /*  set by fifo_safe_point, cleared by sampler for each sample */
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+static void field_wait(double deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) deadline;
+    ts.tv_nsec = (long) (1.0e9*(deadline - ts.tv_sec));
+    pthread_cond_timedwait(&field_cond, &field_mutex, &ts);
+}
+
+static void field_free(field_entry *field)
+{
+    free(field->snapshot);
+    free(field->img);
+    field->snapshot = NULL;
+    field->img = NULL;
+}
+
+/* Quantize and encode snapshot of field (called by sampler thread without lock,
+   with scale_mode, clip_percent and linthresh copied while the lock was held)
+*/
+static void field_encode(field_entry *field, int scale_mode, double clip_percent, double linthresh)
+{
+    int colors[3*256], alphas[256];
+    int n_alphas, reverse, width, height;
+    double data_min, data_max, range_min, range_max;
+
+    if (!pipe_subscribed(field->pipe_num, &width, &height))
+        return;
+
+    trace_frame_start(field->pipe_num);
+    if (quantize_field(field->snapshot, field->elem_size, field->width, field->height,
+                       field->min_value, field->max_value, scale_mode, clip_percent, linthresh, 0, 0, 0.0,
+                       field->img, &data_min, &data_max, &range_min, &range_max) < 0)
+        return;
+
+    if (field->label[0]) {
+        if (field->max_value > field->min_value || clip_percent > 0.0)
+            write_to_pipe_formatted(field->pipe_num, "%s Max=%.5g, Min=%.5g, DataMax=%.5g, DataMin=%.5g\n", field->label,
+                                    range_max, range_min, data_max, data_min);
+        else
+            write_to_pipe_formatted(field->pipe_num, "%s Max=%.5g, Min=%.5g\n", field->label, range_max, range_min);
+    }
+
+    field_colormap(field->colormap_code, 1.0, colors, alphas, &n_alphas, &reverse);
+    encode_image(field->pipe_num, field->img, field->width, field->height, reverse, colors, 256,
+                 n_alphas ? alphas : NULL, n_alphas);
+}
+
+static void *field_sampler(void *arg)
+{
+    int due[FIFO_MAX_FIELDS], due_scale_mode[FIFO_MAX_FIELDS];
+    double due_clip_percent[FIFO_MAX_FIELDS], due_linthresh[FIFO_MAX_FIELDS];
+    int i, n_due, snapshot_done;
+    double now, next, deadline;
+    field_entry *field;
+
+    pthread_mutex_lock(&field_mutex);
+    while (!field_stop) {
+        now = monotonic_time();
+        next = now + 1.0;
+        n_due = 0;
+        for (i = 0; i < FIFO_MAX_FIELDS; i++) {
+            field = &field_list[i];
+            if (!field->active)
+                continue;
+            if (field->next_time <= now)
+                due[n_due++] = i;
+            else if (field->next_time < next)
+                next = field->next_time;
+        }
+
+        if (!n_due) {
+            field_wait(next);
+            continue;
+        }
+
+        for (i = 0; i < n_due; i++)
+            field_list[due[i]].next_time = now + field_list[due[i]].interval;
+
+        snapshot_done = 0;
+        if (__atomic_exchange_n(&safe_point_seen, 0, __ATOMIC_RELAXED)) {
+            /* Safe point reached since previous sample: request snapshots at next safe point */
+            for (i = 0; i < n_due; i++)
+                field_list[due[i]].pending = 1;
+            __atomic_store_n(&snapshot_request, 1, __ATOMIC_RELEASE);
+
+            deadline = now + FIFO_SNAPSHOT_WAIT;
+            while (__atomic_load_n(&snapshot_request, __ATOMIC_ACQUIRE) && !field_stop && monotonic_time() < deadline)
+                field_wait(deadline);
+
+            snapshot_done = !__atomic_load_n(&snapshot_request, __ATOMIC_ACQUIRE);
+            if (!snapshot_done) {
+                /* No safe point reached; copy directly instead */
+                __atomic_store_n(&snapshot_request, 0, __ATOMIC_RELEASE);
+                for (i = 0; i < n_due; i++)
+                    field_list[due[i]].pending = 0;
+            }
+        }
+        if (!snapshot_done) {
+            for (i = 0; i < n_due; i++) {
+                field = &field_list[due[i]];
+                if (field->active)
+                    memcpy(field->snapshot, field->data, field->elem_size*field->width*field->height);
+            }
+        }
+
+        for (i = 0; i < n_due; i++) {
+            field = &field_list[due[i]];
+            field->busy = field->active;
+            due_scale_mode[i] = field->scale_mode;
+            due_clip_percent[i] = field->clip_percent;
+            due_linthresh[i] = field->linthresh;
+        }
+
+        pthread_mutex_unlock(&field_mutex);
+        for (i = 0; i < n_due; i++) {
+            if (field_list[due[i]].busy)
+                field_encode(&field_list[due[i]], due_scale_mode[i], due_clip_percent[i], due_linthresh[i]);
+        }
+        pthread_mutex_lock(&field_mutex);
+
+        for (i = 0; i < n_due; i++) {
+            field = &field_list[due[i]];
+            field->busy = 0;
+            if (!field->active)
+                field_free(field);
+        }
+        pthread_cond_broadcast(&field_cond);
+    }
+    pthread_mutex_unlock(&field_mutex);
+
+    return NULL;
+}
+
+
+/* Fortran-callable function that registers a real(width,height) field array (elem_size 4 for float, 8 for double),
+to be plotted every interval seconds by the sampler thread, with the label (if not empty), range and colormap_code
+of fifo_plot2d (if max_value <= min_value, the range is determined from the data).
+The array must remain allocated until unregister_field or stop_field_sampler is called.
+Returns field id (>= 0) on success, or -1 on error.
+*/
+int register_field(int pipe_num, const void *data, int elem_size, int width, int height, const char *label,
+                   double min_value, double max_value, int colormap_code, double interval)
+{
+    pthread_condattr_t attr;
+    field_entry *field;
+    int field_id;
+
+    if (!check_pipe_num(pipe_num) || !data || width <= 0 || height <= 0)
+        return -1;
+
+    if (elem_size != sizeof(float) && elem_size != sizeof(double)) {
+        fprintf(stderr, "FIFO:register_field: Invalid element size %d\n", elem_size);
+        return -1;
+    }
+
+    pthread_mutex_lock(&field_mutex);
+
+    for (field_id = 0; field_id < FIFO_MAX_FIELDS; field_id++) {
+        if (!field_list[field_id].active && !field_list[field_id].busy)
+            break;
+    }
+    if (field_id >= FIFO_MAX_FIELDS) {
+        pthread_mutex_unlock(&field_mutex);
+        fprintf(stderr, "FIFO:register_field: Too many registered fields\n");
+        return -1;
+    }
+
+    field = &field_list[field_id];
+    field->snapshot = malloc(elem_size*width*height);
+    field->img = malloc(width*height);
+    if (!field->snapshot || !field->img) {
+        field_free(field);
+        pthread_mutex_unlock(&field_mutex);
+        fprintf(stderr, "FIFO:register_field: Failed to allocate snapshot\n");
+        return -1;
+    }
+
+    field->pipe_num = pipe_num;
+    field->data = data;
+    field->elem_size = elem_size;
+    field->width = width;
+    field->height = height;
+    snprintf(field->label, FIFO_LINEMAX, "%s", label ? label : "");
+    field->min_value = min_value;
+    field->max_value = max_value;
+    field->colormap_code = colormap_code;
+    field->scale_mode = LINEAR_SCALE;
+    field->clip_percent = 0.0;
+    field->linthresh = 0.0;
+    field->interval = (interval > 0.0) ? interval : 1.0;
+    field->next_time = monotonic_time();
+    field->pending = 0;
+    field->active = 1;
+
+    if (!field_thread_running) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&field_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        field_stop = 0;
+        if (pthread_create(&field_thread, NULL, field_sampler, NULL) != 0) {
+            perror("FIFO:register_field: Failed to create sampler thread");
+            field->active = 0;
+            field_free(field);
+            pthread_mutex_unlock(&field_mutex);
+            return -1;
+        }
+        field_thread_running = 1;
+    }
+
+    pthread_cond_broadcast(&field_cond);
+    pthread_mutex_unlock(&field_mutex);
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:register_field: %d, %dx%d, pipe %d\n", field_id, width, height, pipe_num);
+#endif
+    return field_id;
+}
+
+
+/* Fortran-callable function that stops sampling a registered field.
+Returns 0 on success, or -1 on error.
+*/
+int unregister_field(int field_id)
+{
+    field_entry *field;
+
+    if (field_id < 0 || field_id >= FIFO_MAX_FIELDS)
+        return -1;
+
+    pthread_mutex_lock(&field_mutex);
+    field = &field_list[field_id];
+    if (!field->active) {
+        pthread_mutex_unlock(&field_mutex);
+        return -1;
+    }
+    field->active = 0;
+    field->pending = 0;
+    if (!field->busy)
+        field_free(field);
+    pthread_mutex_unlock(&field_mutex);
+    return 0;
+}
+
+
+/* Fortran-callable function that sets the scale_mode, clip_percent and linthresh (0 for default)
+of a registered field (see quantize_field).
+Returns 0 on success, or -1 on error.
+*/
+int set_field_scaling(int field_id, int scale_mode, double clip_percent, double linthresh)
+{
+    if (field_id < 0 || field_id >= FIFO_MAX_FIELDS)
+        return -1;
+
+    pthread_mutex_lock(&field_mutex);
+    if (!field_list[field_id].active) {
+        pthread_mutex_unlock(&field_mutex);
+        return -1;
+    }
+    field_list[field_id].scale_mode = scale_mode;
+    field_list[field_id].clip_percent = clip_percent;
+    field_list[field_id].linthresh = linthresh;
+    pthread_mutex_unlock(&field_mutex);
+    return 0;
+}
+
+
+/* Fortran-callable function marking a point where all registered field arrays are consistent.
+Snapshots requested by the sampler thread are copied here; otherwise only a flag is checked.
+*/
+void fifo_safe_point()
+{
+    int i;
+
+    if (!__atomic_load_n(&safe_point_seen, __ATOMIC_RELAXED))
+        __atomic_store_n(&safe_point_seen, 1, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n(&snapshot_request, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&field_mutex);
+    for (i = 0; i < FIFO_MAX_FIELDS; i++) {
+        if (field_list[i].pending) {
+            if (field_list[i].active)
+                memcpy(field_list[i].snapshot, field_list[i].data,
+                       field_list[i].elem_size*field_list[i].width*field_list[i].height);
+            field_list[i].pending = 0;
+        }
+    }
+    __atomic_store_n(&snapshot_request, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&field_cond);
+    pthread_mutex_unlock(&field_mutex);
+}
+
+
+/* Fortran-callable function that unregisters all fields and stops the sampler thread */
+void stop_field_sampler()
+{
+    int i;
+
+    if (!field_thread_running)
+        return;
+
+    pthread_mutex_lock(&field_mutex);
+    field_stop = 1;
+    pthread_cond_broadcast(&field_cond);
+    pthread_mutex_unlock(&field_mutex);
+
+    pthread_join(field_thread, NULL);
+    pthread_cond_destroy(&field_cond);
+    field_thread_running = 0;
+
+    for (i = 0; i < FIFO_MAX_FIELDS; i++) {
+        field_free(&field_list[i]);
+        memset(&field_list[i], 0, sizeof(field_entry));
+    }
+    snapshot_request = 0;
+    safe_point_seen = 0;
+}
+
+#else
+
+int register_field(int pipe_num, const void *data, int elem_size, int width, int height, const char *label,
+                   double min_value, double max_value, int colormap_code, double interval)
+{
+    fprintf(stderr, "FIFO:register_field: Not available (compile with -DFIFO_THREADS)\n");
+    return -1;
+}
+
+int unregister_field(int field_id)
+{
+    return -1;
+}
+
+int set_field_scaling(int field_id, int scale_mode, double clip_percent, double linthresh)
+{
+    return -1;
+}
+
+void fifo_safe_point()
+{
+}
+
+void stop_field_sampler()
+{
+}
+
+/* End of FIFO_THREADS */
+#endif
+
+
+/* Command reader thread (-DFIFO_THREADS)
+
+   A background thread reads the input named pipe (or Unix domain socket), splits the input into lines,
+   and pushes each command line into a single-producer/single-consumer ring buffer.
+   The model thread polls the ring with fifo_poll_command, which never makes a system call.
+   Control lines starting with "fifo:" (e.g., subscriptions from fifofum.py) are processed by
+   the reader thread itself, and are not queued. Text messages from WebSocket clients of the embedded
+   server are also queued (producers are serialized by a mutex; the consumer takes no lock).
+*/
+
+#ifdef FIFO_THREADS
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FIFO_COMMAND_SLOTS 64
+#define FIFO_COMMAND_MAX  256
+
+static char command_ring[FIFO_COMMAND_SLOTS][FIFO_COMMAND_MAX];
+static int command_lengths[FIFO_COMMAND_SLOTS];
+static unsigned int command_head = 0;          /*  written only by producer */
+static unsigned int command_tail = 0;          /*  written only by consumer */
+static int command_dropped = 0;
+static pthread_mutex_t command_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t command_thread;
+static int command_running = 0;
+static int command_stop_fds[2] = {-1, -1};
+static char command_path[FIFO_PATHMAX];
+
+/* Push command line into ring, or process it if it is a control line. Returns 0 on success, or -1 if ring is full */
+int command_push(const char *line, int length)
+{
+    unsigned int head;
+
+    if (length >= 5 && strncmp(line, "fifo:", 5) == 0) {
+        char control[FIFO_COMMAND_MAX*4];
+        snprintf(control, sizeof(control), "%.*s", length, line);
+        update_subscriptions(control);
+        return 0;
+    }
+
+    pthread_mutex_lock(&command_mutex);
+    head = command_head;
+    if (head - __atomic_load_n(&command_tail, __ATOMIC_ACQUIRE) >= FIFO_COMMAND_SLOTS) {
+        command_dropped++;
+        pthread_mutex_unlock(&command_mutex);
+        return -1;
+    }
+
+    if (length > FIFO_COMMAND_MAX-1)
+        length = FIFO_COMMAND_MAX-1;
+    memcpy(command_ring[head % FIFO_COMMAND_SLOTS], line, length);
+    command_ring[head % FIFO_COMMAND_SLOTS][length] = '\0';
+    command_lengths[head % FIFO_COMMAND_SLOTS] = length;
+    __atomic_store_n(&command_head, head+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&command_mutex);
+    return 0;
+}
+
+/* Open input named pipe (creating it, if need be), or connect to Unix domain socket, returning fd or -1 */
+static int command_open(const char *path, int *dummy_fd)
+{
+    struct stat status;
+    struct sockaddr_un addr;
+    int fd;
+
+    *dummy_fd = -1;
+    if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        if (strlen(path) >= sizeof(addr.sun_path))
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    fd = open_read_fd(path);
+    if (fd >= 0)
+        *dummy_fd = open(path, O_WRONLY|O_NONBLOCK);  /* Keep pipe open, so that read never returns EOF */
+    return fd;
+}
+
+static void *command_reader(void *arg)
+{
+    char buf[FIFO_COMMAND_MAX*4];
+    char line[FIFO_COMMAND_MAX*4];
+    struct pollfd fds[2];
+    int fd, dummy_fd, count, i, length;
+
+    fd = command_open(command_path, &dummy_fd);
+    length = 0;
+
+    for (;;) {
+        fds[0].fd = command_stop_fds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, (fd < 0) ? 1000 : -1) < 0 && errno != EINTR)
+            break;
+        if (fds[0].revents)
+            break;
+
+        if (fd < 0) {
+            /* Retry connecting to socket */
+            fd = command_open(command_path, &dummy_fd);
+            continue;
+        }
+        if (!fds[1].revents)
+            continue;
+
+        count = read(fd, buf, sizeof(buf));
+        if (count < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (count <= 0) {
+            /* Socket closed by writer */
+            close(fd);
+            fd = -1;
+            length = 0;
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (buf[i] == '\n') {
+                if (length && line[length-1] == '\r')
+                    length--;
+                if (length)
+                    command_push(line, length);
+                length = 0;
+            } else if (length < (int) sizeof(line)-1) {
+                line[length++] = buf[i];
+            }
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    if (dummy_fd >= 0)
+        close(dummy_fd);
+    return NULL;
+}
+
+
+/* Fortran-callable function that starts the background command reader thread for the input named pipe path
+(created, if need be), or Unix domain socket path. Commands are retrieved using fifo_poll_command.
+Returns 0 on success, or -1 on error.
+*/
+int start_command_reader(const char *path)
+{
+    if (command_running) {
+        fprintf(stderr, "FIFO:start_command_reader: Already running\n");
+        return -1;
+    }
+
+    if (!path || strlen(path) >= FIFO_PATHMAX) {
+        fprintf(stderr, "FIFO:start_command_reader: Invalid path\n");
+        return -1;
+    }
+    snprintf(command_path, FIFO_PATHMAX, "%s", path);
+
+    if (pipe(command_stop_fds) < 0) {
+        perror("FIFO:start_command_reader: Failed to create pipe");
+        return -1;
+    }
+
+    if (pthread_create(&command_thread, NULL, command_reader, NULL) != 0) {
+        perror("FIFO:start_command_reader: Failed to create thread");
+        close(command_stop_fds[0]);
+        close(command_stop_fds[1]);
+        command_stop_fds[0] = command_stop_fds[1] = -1;
+        return -1;
+    }
+    command_running = 1;
+    return 0;
+}
+
+
+/* Fortran-callable function that retrieves the next command line (without new line) into buf (NUL terminated),
+returning its length (truncated to maxlen-1), or 0 if no command is available. Never blocks or makes a system call.
+*/
+int fifo_poll_command(char *buf, int maxlen)
+{
+    unsigned int tail;
+    int length;
+
+    tail = command_tail;
+    if (tail == __atomic_load_n(&command_head, __ATOMIC_ACQUIRE) || maxlen <= 0)
+        return 0;
+
+    length = command_lengths[tail % FIFO_COMMAND_SLOTS];
+    if (length > maxlen-1)
+        length = maxlen-1;
+    memcpy(buf, command_ring[tail % FIFO_COMMAND_SLOTS], length);
+    buf[length] = '\0';
+    __atomic_store_n(&command_tail, tail+1, __ATOMIC_RELEASE);
+    return length;
+}
+
+
+/* Fortran-callable function that stops the command reader thread */
+void stop_command_reader()
+{
+    if (!command_running)
+        return;
+
+    write(command_stop_fds[1], "", 1);
+    pthread_join(command_thread, NULL);
+    close(command_stop_fds[0]);
+    close(command_stop_fds[1]);
+    command_stop_fds[0] = command_stop_fds[1] = -1;
+    command_running = 0;
+
+    if (command_dropped)
+        fprintf(stderr, "FIFO:stop_command_reader: %d commands dropped (queue full)\n", command_dropped);
+    command_dropped = 0;
+}
+
+#else
+
+int start_command_reader(const char *path)
+{
+    fprintf(stderr, "FIFO:start_command_reader: Not available (compile with -DFIFO_THREADS)\n");
+    return -1;
+}
+
+int fifo_poll_command(char *buf, int maxlen)
+{
+    return 0;
+}
+
+void stop_command_reader()
+{
+}
+
+/* End of FIFO_THREADS */
+#endif
+
+
+/* Embedded HTTP/WebSocket server (-DFIFO_SERVER)
+
+   A single server thread runs an epoll loop that serves the viewer page and streams
+   the lines written to server pipes (see allocate_server_pipe) to WebSocket clients,
+   using the same "channel:data_URL" message format as fifofum.py.
+   The model thread only copies each completed line into a reference counted message and
+   signals the server thread; it never blocks on a socket.
+   Clients that cannot keep up skip stale frames: a queued message that has not yet been sent
+   is replaced by a newer message for the same channel.
+   The most recent image and text for each channel are retained for clients that connect later.
+
+   The same loop also serves socket pipes (see allocate_socket_pipe): each pipe listens on a Unix domain
+   socket and any number of local readers (fifofum.py, cat, loggers) may connect. Each completed frame
+   is copied once into a message that is shared by reference across the bounded queues of all readers.
+*/
+
+#ifdef FIFO_SERVER
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FIFO_MAX_CLIENTS    32
+#define FIFO_MAX_LISTENERS  16
+#define FIFO_MAX_CHANNELS   64
+#define FIFO_CLIENT_QUEUE   16
+#define FIFO_OUTBOX_MAX    256
+#define FIFO_REQUEST_MAX  4096
+#define FIFO_WS_HDRMAX      10
+
+#define LISTEN_TAG  FIFO_MAX_CLIENTS   /* + listener index */
+#define WAKE_TAG    (FIFO_MAX_CLIENTS+FIFO_MAX_LISTENERS)
+
+/* Message kinds */
+#define MSG_TEXT    0
+#define MSG_IMAGE   1
+#define MSG_CONTROL 2   /* HTTP response or WebSocket control frame (never dropped) */
+#define MSG_CLOSE   3   /* close socket pipe listener and readers (processed by server thread) */
+
+/* Client states */
+#define CLIENT_FREE    0
+#define CLIENT_HTTP    1
+#define CLIENT_WS      2
+#define CLIENT_CLOSING 3  /* close after queue is drained */
+#define CLIENT_RAW     4  /* socket pipe reader */
+
+struct fifo_msg {
+    int refs;                        /*  reference count (shared by all client queues) */
+    int kind;
+    int pipe_num;                    /*  socket pipe number, or -1 for WebSocket clients */
+    int listener;                    /*  listener id of socket pipe (pipe numbers may be reused) */
+    int directive;                   /*  series:/trace:/tile: line (not kept as latest text of channel) */
+    char channel[FIFO_NAMEMAX];
+    int len;                         /*  number of bytes to send */
+    char data[1];
+};
+
+typedef struct fifo_msg fifo_msg;
+
+struct server_client {
+    int fd;
+    int state;
+    int listener;                    /*  listener id of socket pipe (for CLIENT_RAW) */
+    char in_buf[FIFO_REQUEST_MAX];
+    int in_len;
+    fifo_msg *queue[FIFO_CLIENT_QUEUE];
+    int n_queued;
+    int sent;                        /*  bytes of queue[0] already sent */
+    int replay;                      /*  next channel to replay to new WebSocket client (see client_replay) */
+    int has_subs;                    /*  subscriptions received from browser */
+    char subs[FIFO_REQUEST_MAX];     /*  subscription tokens (see update_subscriptions) */
+};
+
+typedef struct server_client server_client;
+
+struct server_channel {
+    char name[FIFO_NAMEMAX];
+    fifo_msg *image;                 /*  latest image message */
+    fifo_msg *text;                  /*  latest text message */
+};
+
+struct server_listener {
+    int fd;
+    int pipe_num;                    /*  socket pipe number, or -1 for HTTP */
+    int id;                          /*  unique listener id */
+    char path[108];                  /*  Unix domain socket path */
+};
+
+static int server_running = 0;
+static struct server_listener listeners[FIFO_MAX_LISTENERS];
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static pthread_t server_thread;
+static pthread_mutex_t outbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fifo_msg *outbox[FIFO_OUTBOX_MAX];
+static int n_outbox = 0;
+static server_client clients[FIFO_MAX_CLIENTS];
+static struct server_channel channels[FIFO_MAX_CHANNELS];
+static fifo_msg *page_msg = NULL;
+static fifo_msg *field16_msg = NULL;         /* /field16.js (see field16_script_msg) */
+static int listener_serial = 0;
+static int socket_listeners[FIFO_MAX_PIPES];  /* listener id of each socket pipe */
+
+static const char *viewer_page =
+"<!DOCTYPE html>\n"
+"<html>\n"
+"<head>\n"
+"<title>FIFO pipe server</title>\n"
+"<script src='/field16.js'></script>\n"
+"<script>\n"
+"    function appendPipeElement(pipeName, containerId) {\n"
+"        var container = document.getElementById(containerId);\n"
+"        container.appendChild(document.createElement('hr'));\n"
+"        var div = document.createElement('div');\n"
+"        div.id = 'div_'+pipeName;\n"
+"        div.innerHTML = '<p><h3>'+pipeName+' output <input type=\"checkbox\" class=\"fifo-show\" checked></h3>';\n"
+"        container.appendChild(div);\n"
+"        var body = document.createElement('div');\n"
+"        div.appendChild(body);\n"
+"        var show = div.getElementsByClassName('fifo-show')[0];\n"
+"        show.name = pipeName;\n"
+"        show.onchange = function() {\n"
+"            body.style.display = show.checked ? '' : 'none';\n"
+"            sendSubscriptions();\n"
+"        };\n"
+"        var img = document.createElement('img');\n"
+"        img.id = 'img_'+pipeName;\n"
+"        img.style.maxWidth = '100%';\n"
+"        body.appendChild(img);\n"
+"        var pre = document.createElement('div');\n"
+"        pre.id = 'pre_'+pipeName;\n"
+"        pre.style['white-space'] = 'pre-wrap';\n"
+"        pre.style['font-family'] = 'monospace';\n"
+"        body.appendChild(pre);\n"
+"        sendSubscriptions();\n"
+"    }\n"
+"\n"
+"    function sendSubscriptions() {\n"
+"        /* Channels shown in this tab, with display resolution (see update_subscriptions) */\n"
+"        if (FIFOsocket.readyState !== 1)\n"
+"            return;\n"
+"        var scale = window.devicePixelRatio || 1;\n"
+"        var res = Math.round(document.getElementById('pipeContainer').clientWidth*scale) + 'x' +\n"
+"                  Math.round(window.innerHeight*scale);\n"
+"        var msg = 'fifo:subscribe';\n"
+"        var boxes = document.getElementsByClassName('fifo-show');\n"
+"        for (var i = 0; i < boxes.length; i++)\n"
+"            msg += ' ' + boxes[i].name + '=' + ((boxes[i].checked && !document.hidden) ? res : '-');\n"
+"        FIFOsocket.send(msg);\n"
+"    }\n"
+"\n"
+"    function raw_to_png(b64data) {\n"
+"       /* Raw byte format: width mod 256, width/256, height mod 256, height/256, 256*(r,g,b,a) table, width*height*color_index */\n"
+"       var i, j, color_offset;\n"
+"       var raw = window.atob(b64data);\n"
+"       var width = raw.charCodeAt(0) + 256*raw.charCodeAt(1);\n"
+"       var height = raw.charCodeAt(2) + 256*raw.charCodeAt(3);\n"
+"       var cmap_offset = 4;\n"
+"       var pixel_offset = cmap_offset + 4*256;\n"
+"       var canvas = document.createElement('canvas');\n"
+"       canvas.width = width;\n"
+"       canvas.height = height;\n"
+"       var ctx = canvas.getContext('2d');\n"
+"       var imageData = ctx.getImageData(0, 0, width, height);\n"
+"       var data = imageData.data;\n"
+"       for (i = 0; i < raw.length-pixel_offset; i++) {\n"
+"          color_offset = cmap_offset + 4*raw.charCodeAt(pixel_offset+i);\n"
+"          for (j = 0; j < 4; j++)\n"
+"             data[4*i+j] = raw.charCodeAt(color_offset+j);\n"
+"       }\n"
+"       ctx.putImageData(imageData, 0, 0);\n"
+"       return canvas.toDataURL('image/png');\n"
+"    }\n"
+"\n"
+"    var rawImagePrefix = 'data:image/x-raw;base64,';\n"
+"    var protoPrefix = (window.location.protocol === 'https:') ? 'wss:' : 'ws:';\n"
+"    var FIFOsocket = new WebSocket(protoPrefix + '//' + window.location.host + '/ws');\n"
+"\n"
+"    var resizeTimer = null;\n"
+"    FIFOsocket.onopen = sendSubscriptions;\n"
+"    document.addEventListener('visibilitychange', sendSubscriptions);\n"
+"    window.addEventListener('resize', function() {\n"
+"        clearTimeout(resizeTimer);\n"
+"        resizeTimer = setTimeout(sendSubscriptions, 500);\n"
+"    });\n"
+"\n"
+"    FIFOsocket.onmessage = function(evt) {\n"
+"        var msg = evt.data;\n"
+"        var pipeName = 'pipe';\n"
+"        var content = msg;\n"
+"        var indx = msg.indexOf(':');\n"
+"        if (indx > 0) {\n"
+"            pipeName = msg.substr(0,indx);\n"
+"            content = msg.substr(indx+1);\n"
+"        }\n"
+"        if (document.getElementById('div_'+pipeName) === null)\n"
+"            appendPipeElement(pipeName, 'pipeContainer');\n"
+"        if (content.substr(0,22) === 'data:image/png;field16' && typeof field16_image === 'function') {\n"
+"            field16_image(pipeName, content);\n"
+"        } else if (content.substr(0,11) === 'data:image/') {\n"
+"            if (content.substr(0,rawImagePrefix.length) === rawImagePrefix)\n"
+"                content = raw_to_png(content.substr(rawImagePrefix.length));\n"
+"            document.getElementById('img_'+pipeName).src = content;\n"
+"        } else if (content.substr(0,7) === 'series:' || content.substr(0,6) === 'trace:' || content.substr(0,5) === 'tile:') {\n"
+"            // Directive lines (handled by fifofum.py only)\n"
+"        } else {\n"
+"            document.getElementById('pre_'+pipeName).textContent = content;\n"
+"        }\n"
+"    };\n"
+"\n"
+"    FIFOsocket.onclose = function(evt) {\n"
+"        console.log('FIFOsocket.onclose:', evt);\n"
+"    };\n"
+"</script>\n"
+"</head>\n"
+"<body>\n"
+"  <h2>fifofum server</h2>\n"
+"  <div id='pipeContainer'>\n"
+"  </div>\n"
+"</body>\n"
+"</html>\n";
+
+
+/* SHA-1 digest (RFC 3174), needed only for the WebSocket handshake */
+static void sha1_digest(const unsigned char *msg, int length, unsigned char digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint32_t w[80], a, b, c, d, e, f, k, temp;
+    uint64_t bit_len = (uint64_t) length * 8;
+    unsigned char block[64];
+    int i, j, offset;
+    int total = ((length + 8)/64 + 1)*64;  /* padded length */
+
+    for (offset = 0; offset < total; offset += 64) {
+        for (i = 0; i < 64; i++) {
+            j = offset + i;
+            if (j < length)
+                block[i] = msg[j];
+            else if (j == length)
+                block[i] = 0x80;
+            else if (j >= total-8)
+                block[i] = (bit_len >> (8*(total-1-j))) & 0xff;
+            else
+                block[i] = 0;
+        }
+
+        for (i = 0; i < 16; i++)
+            w[i] = ((uint32_t)block[4*i] << 24) | ((uint32_t)block[4*i+1] << 16) | ((uint32_t)block[4*i+2] << 8) | block[4*i+3];
+        for (i = 16; i < 80; i++) {
+            temp = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = (temp << 1) | (temp >> 31);
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (i = 0; i < 20; i++)
+        digest[i] = (h[i/4] >> (24 - 8*(i%4))) & 0xff;
+}
+
+
+/* Allocate message with room for length bytes, with one reference */
+static fifo_msg *msg_alloc(int kind, const char *channel, int length)
+{
+    fifo_msg *msg = malloc(sizeof(fifo_msg) + length);
+    if (msg == NULL)
+        return NULL;
+    msg->refs = 1;
+    msg->kind = kind;
+    msg->pipe_num = -1;
+    msg->listener = 0;
+    msg->directive = 0;
+    msg->len = 0;
+    snprintf(msg->channel, FIFO_NAMEMAX, "%s", channel ? channel : "");
+    return msg;
+}
+
+static fifo_msg *msg_ref(fifo_msg *msg)
+{
+    __sync_add_and_fetch(&msg->refs, 1);
+    return msg;
+}
+
+static void msg_unref(fifo_msg *msg)
+{
+    if (msg && __sync_sub_and_fetch(&msg->refs, 1) == 0)
+        free(msg);
+}
+
+/* Allocate message containing WebSocket frame for text payload prefix+data */
+static fifo_msg *ws_text_msg(int kind, const char *channel, const char *prefix, const char *data, int length)
+{
+    int n_prefix = strlen(prefix);
+    uint64_t payload = n_prefix + length;
+    int i, n_hdr = 0;
+    fifo_msg *msg = msg_alloc(kind, channel, FIFO_WS_HDRMAX + payload);
+
+    if (msg == NULL)
+        return NULL;
+
+    msg->data[n_hdr++] = (char) 0x81;  /* FIN + text frame */
+    if (payload < 126) {
+        msg->data[n_hdr++] = payload;
+    } else if (payload < 65536) {
+        msg->data[n_hdr++] = 126;
+        msg->data[n_hdr++] = (payload >> 8) & 0xff;
+        msg->data[n_hdr++] = payload & 0xff;
+    } else {
+        msg->data[n_hdr++] = 127;
+        for (i = 7; i >= 0; i--)
+            msg->data[n_hdr++] = (payload >> (8*i)) & 0xff;
+    }
+    memcpy(msg->data+n_hdr, prefix, n_prefix);
+    memcpy(msg->data+n_hdr+n_prefix, data, length);
+    msg->len = n_hdr + payload;
+    return msg;
+}
+
+
+/* Called from model thread: queue message for the server thread, replacing any stale image
+   for the same channel that has not been picked up yet. Takes over the reference to msg.
+*/
+static void outbox_push(fifo_msg *msg)
+{
+    int i;
+    uint64_t one = 1;
+    fifo_msg *stale = NULL;
+
+    pthread_mutex_lock(&outbox_mutex);
+    for (i = 0; i < n_outbox && msg->kind == MSG_IMAGE; i++) {
+        if (outbox[i]->kind == MSG_IMAGE && outbox[i]->listener == msg->listener &&
+            strcmp(outbox[i]->channel, msg->channel) == 0) {
+            stale = outbox[i];
+            outbox[i] = msg;
+            break;
+        }
+    }
+    if (!stale) {
+        if (n_outbox == FIFO_OUTBOX_MAX) {
+            for (i = 0; i < n_outbox && outbox[i]->kind == MSG_CLOSE; i++) ;
+            if (i < n_outbox) {
+                stale = outbox[i];
+                memmove(outbox+i, outbox+i+1, (n_outbox-i-1)*sizeof(fifo_msg *));
+                n_outbox--;
+            }
+        }
+        if (n_outbox < FIFO_OUTBOX_MAX)
+            outbox[n_outbox++] = msg;
+        else
+            stale = msg;
+    }
+    pthread_mutex_unlock(&outbox_mutex);
+
+    msg_unref(stale);
+    write(wake_fd, &one, sizeof(one));
+}
+
+
+/* Called from model thread: queue line for broadcast to all WebSocket clients (never blocks on sockets).
+   Returns 0 on success, or -1 on error
+*/
+int server_publish(const char *channel, const char *line, int length)
+{
+    int kind;
+    char prefix[FIFO_NAMEMAX+1];
+    fifo_msg *msg;
+
+    if (!server_running)
+        return -1;
+
+    kind = (length >= 11 && strncmp(line, "data:image/", 11) == 0) ? MSG_IMAGE : MSG_TEXT;
+    if (!channel[0])
+        channel = "pipe";
+    snprintf(prefix, sizeof(prefix), "%s:", channel);
+
+    msg = ws_text_msg(kind, channel, prefix, line, length);
+    if (msg == NULL)
+        return -1;
+
+    msg->directive = (kind == MSG_TEXT) && ((length >= 7 && strncmp(line, "series:", 7) == 0) ||
+                                            (length >= 6 && strncmp(line, "trace:", 6) == 0) ||
+                                            (length >= 5 && strncmp(line, "tile:", 5) == 0));
+    outbox_push(msg);
+    return 0;
+}
+
+
+/* Called from model thread: queue frame for all readers of socket pipe (never blocks on sockets).
+   Each message is self-contained: it is preceded by the current channel directive (if any),
+   so that readers that connect, or skip frames, in the middle of a stream still see complete frames.
+   Returns 0 on success, or -1 on error
+*/
+int socket_publish(int pipe_num, const char *channel, const char *line, int length)
+{
+    int n_prefix, kind;
+    fifo_msg *msg;
+
+    if (!server_running)
+        return -1;
+
+    kind = (length >= 11 && strncmp(line, "data:image/", 11) == 0) ? MSG_IMAGE : MSG_TEXT;
+    msg = msg_alloc(kind, channel, FIFO_NAMEMAX + 10 + length);
+    if (msg == NULL)
+        return -1;
+
+    n_prefix = channel[0] ? sprintf(msg->data, "channel:%s\n", channel) : 0;
+    memcpy(msg->data+n_prefix, line, length);
+    msg->data[n_prefix+length] = '\n';
+    msg->len = n_prefix + length + 1;
+    msg->pipe_num = pipe_num;
+    msg->listener = socket_listeners[pipe_num];
+
+    outbox_push(msg);
+    return 0;
+}
+
+
+/* Merge subscription into union (resolution 0 means any, and so dominates) */
+static void merge_subscription(fifo_sub *merged, const fifo_sub *sub)
+{
+    if (sub->width < 0)
+        return;
+    if (merged->width < 0) {
+        merged->width = sub->width;
+        merged->height = sub->height;
+    } else if (!merged->width || !sub->width) {
+        merged->width = 0;
+        merged->height = 0;
+    } else {
+        merged->width = (sub->width > merged->width) ? sub->width : merged->width;
+        merged->height = (sub->height > merged->height) ? sub->height : merged->height;
+    }
+}
+
+/* Update subscriptions of server pipes to the union of those of all browser clients */
+static void server_subscriptions()
+{
+    static fifo_sub merged[FIFO_MAX_SUBS], table[FIFO_MAX_SUBS+1];
+    static char line[FIFO_MAX_SUBS*(FIFO_NAMEMAX+24)+32];
+    int ic, i, j, n, n_merged, n_ws, offset;
+
+    n_merged = 0;
+    n_ws = 0;
+    for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+        if (clients[ic].state != CLIENT_WS)
+            continue;
+        n_ws++;
+        if (!clients[ic].has_subs)
+            continue;
+        n = parse_subscriptions(clients[ic].subs, table, FIFO_MAX_SUBS);
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < n_merged && strcmp(merged[j].name, table[i].name) != 0; j++) ;
+            if (j == n_merged) {
+                if (n_merged == FIFO_MAX_SUBS)
+                    continue;
+                merged[n_merged++] = table[i];
+            } else {
+                merge_subscription(&merged[j], &table[i]);
+            }
+        }
+    }
+
+    /* Channels not listed are encoded, unless there are no browsers */
+    offset = sprintf(line, "fifo:subscribe *=%s", n_ws ? "0x0" : "-");
+    for (j = 0; j < n_merged; j++) {
+        if (merged[j].width < 0)
+            offset += sprintf(line+offset, " %s=-", merged[j].name);
+        else
+            offset += sprintf(line+offset, " %s=%dx%d", merged[j].name, merged[j].width, merged[j].height);
+    }
+    store_subscriptions(SUB_SERVER, line);
+}
+
+
+static void client_close(int ic)
+{
+    int i, was_ws;
+    server_client *client = &clients[ic];
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:client_close: %d\n", ic);
+#endif
+
+    if (client->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+    }
+    for (i = 0; i < client->n_queued; i++)
+        msg_unref(client->queue[i]);
+    was_ws = (client->state == CLIENT_WS);
+    client->fd = -1;
+    client->state = CLIENT_FREE;
+    client->in_len = 0;
+    client->n_queued = 0;
+    client->sent = 0;
+    client->replay = FIFO_MAX_CHANNELS;
+    client->has_subs = 0;
+
+    if (was_ws)
+        server_subscriptions();
+}
+
+
+static void client_replay(int ic);
+
+/* Send as much of the client queue as the socket will accept, closing client on error */
+static void client_flush(int ic)
+{
+    ssize_t count;
+    struct epoll_event event;
+    server_client *client = &clients[ic];
+
+    client_replay(ic);
+    while (client->n_queued) {
+        fifo_msg *msg = client->queue[0];
+        count = send(client->fd, msg->data+client->sent, msg->len-client->sent, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client_close(ic);
+            return;
+        }
+        client->sent += count;
+        if (client->sent < msg->len)
+            break;
+        msg_unref(msg);
+        memmove(client->queue, client->queue+1, (client->n_queued-1)*sizeof(fifo_msg *));
+        client->n_queued--;
+        client->sent = 0;
+        client_replay(ic);
+    }
+
+    if (!client->n_queued && client->state == CLIENT_CLOSING) {
+        client_close(ic);
+        return;
+    }
+
+    event.events = client->n_queued ? (EPOLLIN|EPOLLOUT) : EPOLLIN;
+    event.data.u32 = ic;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+
+/* Append message reference to client queue, replacing stale unsent images of the same channel.
+   Text lines (including directives) are only dropped if the queue is full after sending what the socket accepts.
+*/
+static void client_enqueue(int ic, fifo_msg *msg)
+{
+    int i;
+    server_client *client = &clients[ic];
+
+    if (msg->kind == MSG_IMAGE) {
+        for (i = (client->sent ? 1 : 0); i < client->n_queued; i++) {
+            if (client->queue[i]->kind == MSG_IMAGE && strcmp(client->queue[i]->channel, msg->channel) == 0) {
+                msg_unref(client->queue[i]);
+                client->queue[i] = msg_ref(msg);
+                return;
+            }
+        }
+    }
+
+    if (client->n_queued == FIFO_CLIENT_QUEUE) {
+        client_flush(ic);
+        if (client->state == CLIENT_FREE)
+            return;
+    }
+
+    if (client->n_queued == FIFO_CLIENT_QUEUE) {
+        /* Drop oldest unsent message (other than HTTP responses and control frames) */
+        for (i = (client->sent ? 1 : 0); i < client->n_queued && client->queue[i]->kind == MSG_CONTROL; i++) ;
+        if (i >= client->n_queued) {
+            client_close(ic);
+            return;
+        }
+        msg_unref(client->queue[i]);
+        memmove(client->queue+i, client->queue+i+1, (client->n_queued-i-1)*sizeof(fifo_msg *));
+        client->n_queued--;
+    }
+
+    client->queue[client->n_queued++] = msg_ref(msg);
+}
+
+
+/* Queue latest messages of channels for newly connected WebSocket client, a few at a time
+   (as the queue drains), so that the replay never fills the queue and forces messages to be dropped
+*/
+static void client_replay(int ic)
+{
+    server_client *client = &clients[ic];
+
+    while (client->replay < FIFO_MAX_CHANNELS && client->n_queued <= FIFO_CLIENT_QUEUE/2) {
+        struct server_channel *channel = &channels[client->replay++];
+        if (channel->text)
+            client_enqueue(ic, channel->text);
+        if (channel->image)
+            client_enqueue(ic, channel->image);
+    }
+}
+
+
+/* Remember latest message for each channel (for clients that connect later) */
+static void channel_update(fifo_msg *msg)
+{
+    int i, ifree = -1;
+    fifo_msg **latest;
+
+    for (i = 0; i < FIFO_MAX_CHANNELS; i++) {
+        if (channels[i].name[0] && strcmp(channels[i].name, msg->channel) == 0)
+            break;
+        if (ifree < 0 && !channels[i].name[0])
+            ifree = i;
+    }
+
+    if (i == FIFO_MAX_CHANNELS) {
+        if (ifree < 0)
+            return;
+        i = ifree;
+        snprintf(channels[i].name, FIFO_NAMEMAX, "%s", msg->channel);
+    }
+
+    if (msg->directive)
+        return;
+
+    latest = (msg->kind == MSG_IMAGE) ? &channels[i].image : &channels[i].text;
+    msg_unref(*latest);
+    *latest = msg_ref(msg);
+}
+
+
+static void client_request(int ic)
+{
+    char *key, *end;
+    char key_buf[FIFO_REQUEST_MAX];
+    char accept_key[32], response[256];
+    unsigned char digest[20];
+    fifo_msg *msg;
+    server_client *client = &clients[ic];
+
+    client->in_buf[client->in_len] = '\0';
+    if (strstr(client->in_buf, "\r\n\r\n") == NULL) {
+        if (client->in_len >= FIFO_REQUEST_MAX-1)
+            client_close(ic);
+        return;
+    }
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:client_request: %d %.40s\n", ic, client->in_buf);
+#endif
+
+    if (strncmp(client->in_buf, "GET /ws", 7) == 0 && (key = strstr(client->in_buf, "Sec-WebSocket-Key:")) != NULL) {
+        /* WebSocket handshake */
+        for (key += 18; *key == ' '; key++) ;
+        end = strstr(key, "\r\n");
+        snprintf(key_buf, sizeof(key_buf), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", (int)(end-key), key);
+        sha1_digest((unsigned char *) key_buf, strlen(key_buf), digest);
+        b64_string(digest, 20, accept_key);
+
+        snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+        msg = msg_alloc(MSG_CONTROL, "", strlen(response));
+        if (msg == NULL) {
+            client_close(ic);
+            return;
+        }
+        msg->len = strlen(response);
+        memcpy(msg->data, response, msg->len);
+
+        client->state = CLIENT_WS;
+        client->in_len = 0;
+        client_enqueue(ic, msg);
+        msg_unref(msg);
+        server_subscriptions();
+
+        client->replay = 0;  /* Latest message of each channel is queued by client_flush */
+
+    } else if (strncmp(client->in_buf, "GET / ", 6) == 0 || strncmp(client->in_buf, "GET /index.html ", 16) == 0) {
+        client->state = CLIENT_CLOSING;
+        client_enqueue(ic, page_msg);
+
+    } else if (strncmp(client->in_buf, "GET /field16.js ", 16) == 0) {
+        client->state = CLIENT_CLOSING;
+        client_enqueue(ic, field16_msg);
+
+    } else {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        msg = msg_alloc(MSG_CONTROL, "", sizeof(not_found));
+        if (msg == NULL) {
+            client_close(ic);
+            return;
+        }
+        msg->len = sizeof(not_found)-1;
+        memcpy(msg->data, not_found, msg->len);
+        client->state = CLIENT_CLOSING;
+        client_enqueue(ic, msg);
+        msg_unref(msg);
+    }
+
+    client_flush(ic);
+}
+
+
+/* Process complete WebSocket frames received from client (browser frames are always masked) */
+static void client_frames(int ic)
+{
+    int i, opcode, n_hdr;
+    uint64_t length;
+    unsigned char *buf;
+    fifo_msg *msg;
+    server_client *client = &clients[ic];
+
+    for (;;) {
+        buf = (unsigned char *) client->in_buf;
+        if (client->in_len < 2)
+            return;
+        opcode = buf[0] & 0x0f;
+        length = buf[1] & 0x7f;
+        n_hdr = 2;
+        if (length == 126) {
+            if (client->in_len < 4)
+                return;
+            length = (buf[2] << 8) | buf[3];
+            n_hdr = 4;
+        } else if (length == 127) {
+            client_close(ic);  /* Too long */
+            return;
+        }
+        if (!(buf[1] & 0x80) || n_hdr + 4 + length > FIFO_REQUEST_MAX) {
+            client_close(ic);
+            return;
+        }
+        if (client->in_len < n_hdr + 4 + (int)length)
+            return;
+        if ((opcode & 0x8) && length > 125) {
+            client_close(ic);  /* Control frames have at most 125 bytes of payload */
+            return;
+        }
+
+        for (i = 0; i < (int)length; i++)
+            buf[n_hdr+4+i] ^= buf[n_hdr + (i%4)];
+
+        if (opcode == 0x8) {
+            client_close(ic);
+            return;
+        } else if (opcode == 0x9) {
+            /* Pong */
+            msg = msg_alloc(MSG_CONTROL, "", 2 + length);
+            if (msg) {
+                msg->data[0] = (char) 0x8A;
+                msg->data[1] = length;
+                memcpy(msg->data+2, buf+n_hdr+4, length);
+                msg->len = 2 + length;
+                client_enqueue(ic, msg);
+                msg_unref(msg);
+            }
+        } else if (opcode == 0x1 && length >= 14 && strncmp((char *) buf+n_hdr+4, "fifo:subscribe", 14) == 0) {
+            /* Channels open in browser */
+            memcpy(client->subs, buf+n_hdr+4+14, length-14);
+            client->subs[length-14] = '\0';
+            client->has_subs = 1;
+            server_subscriptions();
+        } else if (opcode == 0x1 && length > 0) {
+            /* Command from browser */
+            if (command_push((char *) buf+n_hdr+4, length) < 0)
+                fprintf(stderr, "FIFO:client_frames: Command queue full; dropped command\n");
+        }
+#ifdef DEBUG_FIFO
+        if (opcode == 0x1) {
+            fprintf(stderr, "FIFO:client_frames: %d %.*s\n", ic, (int)length, buf+n_hdr+4);
+        }
+#endif
+
+        client->in_len -= n_hdr + 4 + length;
+        memmove(client->in_buf, client->in_buf + n_hdr + 4 + length, client->in_len);
+    }
+}
+
+
+static void client_read(int ic)
+{
+    ssize_t count;
+    server_client *client = &clients[ic];
+
+    count = recv(client->fd, client->in_buf+client->in_len, FIFO_REQUEST_MAX-1-client->in_len, 0);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        client_close(ic);
+        return;
     }
+    if (count < 0)
+        return;
+    client->in_len += count;
+
+    if (client->state == CLIENT_HTTP)
+        client_request(ic);
+    else if (client->state == CLIENT_WS)
+        client_frames(ic);
+    else
+        client->in_len = 0;  /* Ignore input from socket pipe readers, or while closing */
+}
 
-    /* Image info */
-    info_ptr = png_create_info_struct (png_ptr);
-    if (info_ptr == NULL) {
-        goto png_create_info_struct_failed;
+
+static void server_accept(int il)
+{
+    int fd, ic;
+    struct epoll_event event;
+
+    while ((fd = accept(listeners[il].fd, NULL, NULL)) >= 0) {
+        for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+            if (clients[ic].state == CLIENT_FREE)
+                break;
+        }
+        if (ic == FIFO_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        clients[ic].fd = fd;
+        clients[ic].state = (listeners[il].pipe_num < 0) ? CLIENT_HTTP : CLIENT_RAW;
+        clients[ic].listener = listeners[il].id;
+        clients[ic].in_len = 0;
+        clients[ic].n_queued = 0;
+        clients[ic].sent = 0;
+        clients[ic].replay = FIFO_MAX_CHANNELS;
+        event.events = EPOLLIN;
+        event.data.u32 = ic;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
     }
+}
 
-    /* Set up error handling. */
-    if (setjmp( png_jmpbuf(png_ptr) )) {
-        goto png_failure;
+
+/* Close listener (and any readers) with id */
+static void listener_close(int id)
+{
+    int il, ic;
+
+    for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+        if (clients[ic].state == CLIENT_RAW && clients[ic].listener == id)
+            client_close(ic);
     }
 
-    /* Set image attributes. */
-    png_set_IHDR (png_ptr,
-                  info_ptr,
-                  width,
-                  height,
-                  depth,
-                  PNG_COLOR_TYPE_PALETTE,
-                  PNG_INTERLACE_NONE,
-                  PNG_COMPRESSION_TYPE_DEFAULT,
-                  PNG_FILTER_TYPE_DEFAULT);
+    for (il = 0; il < FIFO_MAX_LISTENERS; il++) {
+        if (listeners[il].fd >= 0 && listeners[il].id == id) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listeners[il].fd, NULL);
+            close(listeners[il].fd);
+            if (listeners[il].path[0])
+                unlink(listeners[il].path);
+            listeners[il].path[0] = '\0';
+            listeners[il].fd = -1;
+        }
+    }
+}
 
-    png_color* palette = (png_color*) png_malloc(png_ptr, palette_size*sizeof(png_color));
 
+/* Add listening socket to server loop, returning listener id (> 0) on success, or -1 on error */
+static int listener_add(int fd, int pipe_num, const char *path)
+{
+    int il, id = -1;
+    struct epoll_event event;
 
-    for (p = 0; p < palette_size; p++) {
-        offset4 = 4*p;
-	png_color* pcol = &palette[p];
-        pcol->red   = rgba[0+offset4];
-        pcol->green = rgba[1+offset4];
-        pcol->blue  = rgba[2+offset4];
-	/* fprintf(stderr, "COL=%d, offset4=%d: RGB (%d, %d, %d)\n", p, offset4, pcol->red, pcol->green, pcol->blue); */
+    pthread_mutex_lock(&outbox_mutex);
+    for (il = 0; il < FIFO_MAX_LISTENERS; il++) {
+        if (listeners[il].fd < 0)
+            break;
     }
+    if (il < FIFO_MAX_LISTENERS) {
+        listeners[il].fd = fd;
+        listeners[il].pipe_num = pipe_num;
+        listeners[il].id = id = ++listener_serial;
+        snprintf(listeners[il].path, sizeof(listeners[il].path), "%s", path ? path : "");
+    }
+    pthread_mutex_unlock(&outbox_mutex);
 
-    png_set_PLTE(png_ptr, info_ptr, palette, palette_size);
+    if (il == FIFO_MAX_LISTENERS) {
+        fprintf(stderr, "FIFO:listener_add: Too many listeners\n");
+        return -1;
+    }
 
-    if (alphas != NULL && n_alphas > 0 && n_alphas <= 256) {
-        /* Set up transparency block, starting from color index 0 */
-        trans_color = (png_bytep) png_malloc(png_ptr, n_alphas * sizeof(png_byte));
-	for (p = 0; p < n_alphas; p++) {
-	  trans_color[p] = rgba[3+4*p];
-	  /* fprintf(stderr, "ALPHA p=%d, alpha=%d\n", p, trans_color[p]); */ 
-	}
-	png_set_tRNS(png_ptr, info_ptr, (png_voidp) trans_color, n_alphas, NULL);
+    event.events = EPOLLIN;
+    event.data.u32 = LISTEN_TAG + il;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    return id;
+}
+
+
+/* Move published messages from the outbox to the client queues */
+static void server_dispatch()
+{
+    int i, ic, n_msgs;
+    uint64_t count;
+    fifo_msg *msgs[FIFO_OUTBOX_MAX];
+
+    read(wake_fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&outbox_mutex);
+    n_msgs = n_outbox;
+    memcpy(msgs, outbox, n_outbox*sizeof(fifo_msg *));
+    n_outbox = 0;
+    pthread_mutex_unlock(&outbox_mutex);
+
+    for (i = 0; i < n_msgs; i++) {
+        if (msgs[i]->kind == MSG_CLOSE) {
+            listener_close(msgs[i]->listener);
+        } else if (msgs[i]->pipe_num < 0) {
+            channel_update(msgs[i]);
+            for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+                if (clients[ic].state == CLIENT_WS)
+                    client_enqueue(ic, msgs[i]);
+            }
+        } else {
+            for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+                if (clients[ic].state == CLIENT_RAW && clients[ic].listener == msgs[i]->listener)
+                    client_enqueue(ic, msgs[i]);
+            }
+        }
+        msg_unref(msgs[i]);
     }
-  
-    png_set_write_fn(png_ptr, (png_voidp) &pipe_list[pipe_num], (png_rw_ptr) write_file,
-                    (png_flush_ptr) flush_file);
 
-    png_write_info(png_ptr, info_ptr);
+    for (ic = 0; ic < FIFO_MAX_CLIENTS; ic++) {
+        if ((clients[ic].state == CLIENT_WS || clients[ic].state == CLIENT_RAW) && clients[ic].n_queued)
+            client_flush(ic);
+    }
+}
 
-    /* Start writing image data */
-    row = (png_bytep) png_malloc(png_ptr, pixel_size * width * sizeof(png_byte));
 
-    for (y=0 ; y<height ; y++) {
-        for (x=0 ; x<width ; x++) {
-            row[x] = img[x+width*y];
-	    /* fprintf(stderr, "IMG(%d,%d) = %d\n", y, x, row[x]); */
+static void *server_loop(void *arg)
+{
+    int i, n_events;
+    uint32_t tag;
+    struct epoll_event events[WAKE_TAG+1];
+
+    while (server_running) {
+        n_events = epoll_wait(epoll_fd, events, WAKE_TAG+1, -1);
+        for (i = 0; i < n_events; i++) {
+            tag = events[i].data.u32;
+            if (tag == WAKE_TAG) {
+                server_dispatch();
+            } else if (tag >= LISTEN_TAG) {
+                if (listeners[tag-LISTEN_TAG].fd >= 0)
+                    server_accept(tag-LISTEN_TAG);
+            } else if (clients[tag].state != CLIENT_FREE) {
+                if (events[i].events & (EPOLLERR|EPOLLHUP)) {
+                    client_close(tag);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                    client_read(tag);
+                if (clients[tag].state != CLIENT_FREE && (events[i].events & EPOLLOUT))
+                    client_flush(tag);
+            }
         }
-        png_write_row(png_ptr, row);
     }
+    return NULL;
+}
 
-    /* End write */
-    png_write_end(png_ptr, NULL);
 
-    write_file(png_ptr, NULL, 0); /* Finalize */
-    flush_pipe(pipe_num);
+/* Start server thread (if not already running), returning 0 on success, or -1 on error */
+static int server_loop_start()
+{
+    int i;
+    struct epoll_event event;
 
-    png_free(png_ptr, row);
+    if (server_running)
+        return 0;
 
-    if (pipe_list[pipe_num].encoding == DATA_URL_ENC)
-        write_to_pipe_formatted(pipe_num, DATA_URL_SUFFIX);
-    if (pipe_list[pipe_num].encoding == GRAPHTERM_ENC)
-        write_to_pipe_formatted(pipe_num, GRAPHTERM_SUFFIX);
+    for (i = 0; i < FIFO_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+        clients[i].state = CLIENT_FREE;
+        clients[i].n_queued = 0;
+        clients[i].replay = FIFO_MAX_CHANNELS;
+    }
+    for (i = 0; i < FIFO_MAX_LISTENERS; i++) {
+        listeners[i].fd = -1;
+        listeners[i].path[0] = '\0';
+    }
 
-    if (pipe_list[pipe_num].stream_ptr) {
-        if (pipe_list[pipe_num].stream_len <= pipe_list[pipe_num].stream_maxlen) {
-	    count = pipe_list[pipe_num].stream_len; /* success! */
-	} else {
-	    count = -pipe_list[pipe_num].stream_len; /* buffer too small */
-	}
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        perror("FIFO:server_loop_start: Failed to create epoll/eventfd");
+        stop_fifo_server();
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.u32 = WAKE_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+    server_running = 1;
+    if (pthread_create(&server_thread, NULL, server_loop, NULL) != 0) {
+        perror("FIFO:server_loop_start: Failed to create server thread");
+        server_running = 0;
+        stop_fifo_server();
+        return -1;
+    }
+    return 0;
+}
+
+
+/* HTTP response for /field16.js, the browser side of encode_field16 (shared with fifofum.py), preceded by
+   the definition of field16Viridis (the 240 colors of VIRIDIS_PLUS_CMAP, as used by fifo_plot2d).
+   The script is read from the path in the environment variable FIFO_FIELD16_JS, or else from the directory
+   of this source file (as compiled); if it is not found, 16-bit fields are displayed without colormap.
+   Returns NULL on allocation failure.
+*/
+static fifo_msg *field16_script_msg()
+{
+    int k, n_colors, n_header;
+    long n_script = 0;
+    char path[FIFO_PATHMAX], colors[4096], header[160];
+    const char *env = getenv("FIFO_FIELD16_JS");
+    const char *slash = strrchr(__FILE__, '/');
+    FILE *fp;
+    fifo_msg *msg;
+
+    if (env && env[0])
+        snprintf(path, sizeof(path), "%s", env);
+    else
+        snprintf(path, sizeof(path), "%.*sfield16.js", slash ? (int) (slash+1-__FILE__) : 0, __FILE__);
+
+    n_colors = sprintf(colors, "var field16Viridis = [");
+    for (k = FIFO_BASIC_COLORS; k < 256; k++)
+        n_colors += sprintf(colors+n_colors, "%s[%d,%d,%d]", (k > FIFO_BASIC_COLORS) ? "," : "",
+                            VIRIDIS_PLUS_CMAP[3*k], VIRIDIS_PLUS_CMAP[3*k+1], VIRIDIS_PLUS_CMAP[3*k+2]);
+    n_colors += sprintf(colors+n_colors, "];\n");
+
+    fp = fopen(path, "r");
+    if (fp && fseek(fp, 0, SEEK_END) == 0 && (n_script = ftell(fp)) > 0) {
+        rewind(fp);
     } else {
-      count = 0;
+        fprintf(stderr, "FIFO:start_fifo_server: %s not found (set FIFO_FIELD16_JS); 16-bit fields will not be colored\n", path);
+        n_script = 0;
     }
 
- png_failure:
- png_create_info_struct_failed:
-    png_destroy_write_struct (&png_ptr, &info_ptr);
- png_create_write_struct_failed:
- /* End of FIFO_NO_PNG */
+    n_header = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/javascript\r\n"
+                        "Content-Length: %ld\r\nConnection: close\r\n\r\n", n_colors+n_script);
+    msg = msg_alloc(MSG_CONTROL, "", n_header+n_colors+n_script);
+    if (msg != NULL) {
+        memcpy(msg->data, header, n_header);
+        memcpy(msg->data+n_header, colors, n_colors);
+        if (n_script > 0 && fread(msg->data+n_header+n_colors, 1, n_script, fp) != (size_t) n_script) {
+            fprintf(stderr, "FIFO:start_fifo_server: Error reading %s\n", path);
+            msg_unref(msg);
+            msg = NULL;
+        } else {
+            msg->len = n_header+n_colors+n_script;
+        }
+    }
+    if (fp)
+        fclose(fp);
+    return msg;
+}
+
+
+/* Fortran-callable function that starts the embedded HTTP/WebSocket server thread,
+listening on addr:port (addr defaults to 127.0.0.1 if NULL or empty).
+Output written to server pipes (see allocate_server_pipe) may then be viewed at http://addr:port
+Returns 0 on success, or -1 on error.
+*/
+
+int start_fifo_server(const char *addr, int port)
+{
+    int listen_fd, reuse = 1;
+    char header[128];
+    struct sockaddr_in sock_addr;
+
+    if (page_msg)
+        return 0;  /* Already listening */
+
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sin_family = AF_INET;
+    sock_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, (addr && addr[0]) ? addr : "127.0.0.1", &sock_addr.sin_addr) != 1) {
+        fprintf(stderr, "FIFO:start_fifo_server: Invalid address %s\n", addr);
+        return -1;
+    }
+
+    if (server_loop_start() < 0)
+        return -1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        perror("FIFO:start_fifo_server: Failed to create socket");
+        return -1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("FIFO:start_fifo_server: Failed to listen on port");
+        close(listen_fd);
+        return -1;
+    }
+
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %d\r\n"
+             "Connection: close\r\n\r\n", (int) strlen(viewer_page));
+    page_msg = msg_alloc(MSG_CONTROL, "", strlen(header)+strlen(viewer_page));
+    field16_msg = field16_script_msg();
+    if (page_msg == NULL || field16_msg == NULL || listener_add(listen_fd, -1, NULL) < 0) {
+        msg_unref(page_msg);
+        msg_unref(field16_msg);
+        page_msg = field16_msg = NULL;
+        close(listen_fd);
+        return -1;
+    }
+    page_msg->len = strlen(header)+strlen(viewer_page);
+    memcpy(page_msg->data, header, strlen(header));
+    memcpy(page_msg->data+strlen(header), viewer_page, strlen(viewer_page));
+
+    fprintf(stderr, "FIFO:start_fifo_server: Listening on http://%s:%d\n", (addr && addr[0]) ? addr : "127.0.0.1", port);
+    return 0;
+}
+
+
+/* Stop server thread, closing all client connections and listening sockets */
+void stop_fifo_server()
+{
+    int i;
+    uint64_t one = 1;
+
+    if (server_running) {
+        server_running = 0;
+        write(wake_fd, &one, sizeof(one));
+        pthread_join(server_thread, NULL);
+    }
+
+    for (i = 0; i < FIFO_MAX_CLIENTS; i++) {
+        if (clients[i].state != CLIENT_FREE)
+            client_close(i);
+    }
+    for (i = 0; i < FIFO_MAX_LISTENERS; i++) {
+        if (listeners[i].fd >= 0)
+            listener_close(listeners[i].id);
+    }
+    for (i = 0; i < FIFO_MAX_CHANNELS; i++) {
+        msg_unref(channels[i].image);
+        msg_unref(channels[i].text);
+        channels[i].image = channels[i].text = NULL;
+        channels[i].name[0] = '\0';
+    }
+    for (i = 0; i < n_outbox; i++)
+        msg_unref(outbox[i]);
+    n_outbox = 0;
+
+    msg_unref(page_msg);
+    msg_unref(field16_msg);
+    page_msg = field16_msg = NULL;
+
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (wake_fd >= 0) close(wake_fd);
+    epoll_fd = wake_fd = -1;
+
+    SUB_LOCK();
+    sub_counts[SUB_SERVER] = -1;  /* Encode all channels of server pipes again */
+    SUB_UNLOCK();
+}
+
+
+/* Fortran-callable function that allocates a pipe whose output is served by the embedded server
+(start_fifo_server must be called first). Lines are encoded as for DATA_URL_ENC and displayed
+in the channel named name, unless switched by a "channel:" directive line.
+Returns pipe number (>= 0) on success or negative value on error
+*/
+
+int allocate_server_pipe(const char *name)
+{
+    int pipe_num;
+
+    if (!page_msg) {
+        fprintf(stderr, "FIFO:allocate_server_pipe: Server not started\n");
+        return -1;
+    }
+
+    pipe_num = get_available_pipe();
+    if (pipe_num < 0)
+        return pipe_num;
+
+    pipe_list[pipe_num].sink = SERVER_SINK;
+    pipe_list[pipe_num].encoding = DATA_URL_ENC;
+    snprintf(pipe_list[pipe_num].channel, FIFO_NAMEMAX, "%s", (name && name[0]) ? name : "pipe");
+
+#ifdef DEBUG_FIFO
+    fprintf(stderr, "FIFO:allocate_server_pipe: %s, %d\n", pipe_list[pipe_num].channel, pipe_num);
 #endif
-    return count;
+    return pipe_num;
 }
 
-/* Create and open named pipe for reading, returning file descriptor (>= 0) */
-int open_read_fd(const char *path)
+
+/* Fortran-callable function that allocates a pipe that listens on the Unix domain socket path,
+accepting any number of local readers (e.g., python fifofum.py path, or socat - UNIX-CONNECT:path).
+Output is encoded as for DATA_URL_ENC. Each line is a separate frame, preceded by the current
+channel directive (if any). Readers that fall behind skip stale frames, rather than blocking the writer.
+Returns pipe number (>= 0) on success or negative value on error
+*/
+
+int allocate_socket_pipe(const char *path)
 {
-    int read_fd, retval;
-    struct stat pipe_status;
- 
-    if (access(path, F_OK) != 0) {
-        retval = mkfifo(path, S_IRUSR|S_IWUSR);
-	if (retval < 0) {
-	    perror("FIFO:open_read_fd: Failed to create new named pipe (FIFO)");
-	    return -1;
-	}
+    int pipe_num, sock_fd, id;
+    struct sockaddr_un sock_addr;
+    struct stat path_status;
+
+    if (!path || strlen(path) >= sizeof(sock_addr.sun_path)) {
+        fprintf(stderr, "FIFO:allocate_socket_pipe: Invalid socket path\n");
+        return -1;
     }
 
-    read_fd = open(path, O_RDONLY | O_NONBLOCK);
-    if (read_fd < 0) {
-      perror("FIFO:open_read_fd: Failed to open pipe for reading");
-      return -1;
+    if (stat(path, &path_status) == 0) {
+        if (!S_ISSOCK(path_status.st_mode)) {
+            fprintf(stderr, "FIFO:allocate_socket_pipe: %s in not a socket! Remove it.\n", path);
+            return -1;
+        }
+        unlink(path);  /* Stale socket from previous run */
     }
-    
-    if (fstat(read_fd, &pipe_status) < 0) {
-        perror("FIFO:open_read_fd: Failed fstat");
-	close(read_fd);
-	return -1;
+
+    if (server_loop_start() < 0)
+        return -1;
+
+    pipe_num = get_available_pipe();
+    if (pipe_num < 0)
+        return pipe_num;
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock_fd < 0) {
+        perror("FIFO:allocate_socket_pipe: Failed to create socket");
+        return -1;
     }
 
-    if (!S_ISFIFO(pipe_status.st_mode)) {
-        fprintf(stderr, "FIFO:open_read_fd: %s in not a named pipe! Remove it.\n", path);
-	close(read_fd);
-	return -1;
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sun_family = AF_UNIX;
+    strcpy(sock_addr.sun_path, path);
+    if (bind(sock_fd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) < 0 || listen(sock_fd, 16) < 0) {
+        perror("FIFO:allocate_socket_pipe: Failed to listen on socket");
+        close(sock_fd);
+        return -1;
+    }
+
+    id = listener_add(sock_fd, pipe_num, path);
+    if (id < 0) {
+        close(sock_fd);
+        unlink(path);
+        return -1;
     }
+    socket_listeners[pipe_num] = id;
+
+    pipe_list[pipe_num].sink = SOCKET_SINK;
+    pipe_list[pipe_num].encoding = DATA_URL_ENC;
 
 #ifdef DEBUG_FIFO
-    fprintf(stderr, "FIFO:open_read_fd: %d %s\n", read_fd, path);
+    fprintf(stderr, "FIFO:allocate_socket_pipe: %s, %d\n", path, pipe_num);
 #endif
-    return read_fd;
+    return pipe_num;
 }
 
-/* Read upto count bytes from fd, returning number of bytes read, or -1 */
-int read_from_fd(int fd, char *buf, int count)
+
+/* Close socket pipe listener and readers (after queued frames have been handed to the server thread) */
+void socket_release(int pipe_num)
 {
-  return read(fd, buf, count);
+    fifo_msg *msg;
+
+    if (!server_running)
+        return;
+
+    msg = msg_alloc(MSG_CLOSE, "", 0);
+    if (msg) {
+        msg->pipe_num = pipe_num;
+        msg->listener = socket_listeners[pipe_num];  /* The pipe number may be reused before the server closes it */
+        outbox_push(msg);
+    }
+    socket_listeners[pipe_num] = 0;
+}
+
+#else
+
+int server_publish(const char *channel, const char *line, int length)
+{
+    return -1;
 }
 
+int socket_publish(int pipe_num, const char *channel, const char *line, int length)
+{
+    return -1;
+}
+
+void socket_release(int pipe_num)
+{
+}
+
+int start_fifo_server(const char *addr, int port)
+{
+    fprintf(stderr, "FIFO:start_fifo_server: Not available (compile with -DFIFO_SERVER)\n");
+    return -1;
+}
+
+void stop_fifo_server()
+{
+}
+
+int allocate_server_pipe(const char *name)
+{
+    fprintf(stderr, "FIFO:allocate_server_pipe: Not available (compile with -DFIFO_SERVER)\n");
+    return -1;
+}
+
+int allocate_socket_pipe(const char *path)
+{
+    fprintf(stderr, "FIFO:allocate_socket_pipe: Not available (compile with -DFIFO_SERVER)\n");
+    return -1;
+}
+
+/* End of FIFO_SERVER */
+#endif
+
 
 #ifdef TEST_MAIN
 
 int main ()
 {
-    int read_fd, img_fd, b64_fd;
+#ifndef FIFO_THREADS
+    int read_fd;
+#endif
+    int img_fd, b64_fd;
     int *img_colors;
     char *img_pixels;
     int p, x, y, x1, y1;
@@ -902,25 +4170,40 @@ int main ()
     /* End of FIFO_NO_PNG */
 #endif
 
-#ifdef TEST_GRAPHTERM
+#if defined(TEST_SERVER)
+    if (start_fifo_server("127.0.0.1", 8008) == 0)
+        pipe_num = allocate_server_pipe("testout");
+#elif defined(TEST_SOCKET)
+    pipe_num = allocate_socket_pipe("testout.sock");
+#elif defined(TEST_GRAPHTERM)
     pipe_num = allocate_file_pipe(pipefile, GRAPHTERM_ENC, 1);
 #else
     pipe_num = allocate_file_pipe(pipefile, DATA_URL_ENC, 1);
 #endif
 
     if (pipe_num >= 0) {
+#ifdef FIFO_THREADS
+        if (start_command_reader(readfile) < 0)
+  	    return -1;
+#else
         read_fd = open_read_fd(readfile);
 	if (read_fd < 0)
   	    return -1;
+#endif
         fprintf(stderr, "fifo_c: Reading from named pipe %s\n", readfile);
         fprintf(stderr, "fifo_c: Writing to named pipe %s; Control-C to exit\n", pipefile);
 	for (x1=0;;) {
   	    sleep(1);
+#ifdef FIFO_THREADS
+	    while ((count = fifo_poll_command(read_buf, FIFO_LINEMAX+1)) > 0)
+	        fprintf(stderr, "fifo_c: Command: %s\n", read_buf);
+#else
 	    count = read_from_fd(read_fd, read_buf, FIFO_LINEMAX+1);
 	    if (count > 0) {
 	        fprintf(stderr, "fifo_c: Read count=%d\n", count);
 	        write(1, read_buf, count);
 	    }
+#endif
 #ifndef TEST_GRAPHTERM
 	    if (x1 > 25)
 	      write_to_pipe_formatted(pipe_num, "channel:channel%d\n", 1 + x1 % 2);
@@ -938,7 +4221,11 @@ int main ()
 		}
 	    }
 	}
+#ifdef FIFO_THREADS
+	stop_command_reader();
+#else
 	close(read_fd);
+#endif
 	free_pipe(pipe_num);
 	pipe_num = -1;
     }
@@ -10,6 +10,8 @@ module fifo_f
   use, intrinsic :: iso_c_binding
   implicit none
 
+  private :: color_index
+
   integer(c_int), bind(c,name="VIRIDIS_CMAP")  :: VIRIDIS_CMAP(3,256)            ! Viridis full 256 color map
   integer(c_int), bind(c,name="VIRIDIS_PLUS_CMAP")  :: VIRIDIS_PLUS_CMAP(3,256)  ! Viridis 240+plus other colors map
 
@@ -21,6 +23,11 @@ module fifo_f
   integer, parameter :: GRAPHTERM_ENC = -2 ! Base64 with GraphTerm prefix and suffix
   ! (Note: Using C binding to access these from fifo_c generates byte alignment warning messages; hence defined here again)
 
+  ! Scale mode values (see fifo_plot2d)
+  integer, parameter :: LINEAR_SCALE  =  0 ! linear
+  integer, parameter :: LOG_SCALE     =  1 ! logarithmic (non-positive values use the first color)
+  integer, parameter :: SYMLOG_SCALE  =  2 ! symmetric logarithmic (linear near zero)
+
   interface
 
       ! Wrappers for most, but not all, exposed fifo_c.c functions (see also auxiliary functions below for the rest)
@@ -48,6 +55,30 @@ module fifo_f
           integer(c_int), value, intent(in) :: pipe_num
       end subroutine flush_pipe
 
+      ! Enable (1) or disable (0, default) fsync for each flush/frame written to file pipe,
+      ! returning 0 on success, or -1 on error
+      ! C prototype:
+      !   int set_pipe_fsync(int pipe_num, int enable);
+
+      function set_pipe_fsync(pipe_num, enable) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: set_pipe_fsync
+          integer(c_int), value, intent(in) :: pipe_num, enable
+      end function set_pipe_fsync
+
+      ! Publish frame accumulated by latest-frame file/mmap pipe (called automatically after each image),
+      ! returning 0 on success, or -1 on error
+      ! C prototype:
+      !   int end_frame(int pipe_num);
+
+      function end_frame(pipe_num) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: end_frame
+          integer(c_int), value, intent(in) :: pipe_num
+      end function end_frame
+
       ! Write to pipe, returning number of bytes written, or -1 on error
       ! C prototype:
       !   int write_to_pipe(int pipe_num, const void *buf, int nbyte);
@@ -95,6 +126,89 @@ module fifo_f
           integer(c_int), value, intent(in) :: fd, count
       end function read_from_fd
 
+      ! Stop embedded server thread (see start_fifo_server), closing all client connections
+      ! C prototype:
+      !   void stop_fifo_server();
+
+      subroutine stop_fifo_server() bind(c)
+          use iso_c_binding
+          implicit none
+      end subroutine stop_fifo_server
+
+      ! Stop sampling a registered field (see register_field), returning 0 on success, or -1 on error
+      ! C prototype:
+      !   int unregister_field(int field_id);
+
+      function unregister_field(field_id) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: unregister_field
+          integer(c_int), value, intent(in) :: field_id
+      end function unregister_field
+
+      ! Mark a point where all registered field arrays are consistent (e.g., once per time step).
+      ! Snapshots requested by the sampler thread are copied here; otherwise only a flag is checked.
+      ! C prototype:
+      !   void fifo_safe_point();
+
+      subroutine fifo_safe_point() bind(c)
+          use iso_c_binding
+          implicit none
+      end subroutine fifo_safe_point
+
+      ! Check whether the current channel of pipe has any subscribers (see update_subscriptions),
+      ! returning 1 if it does (or no subscriptions have been received), or 0 otherwise.
+      ! The largest requested resolution is returned in width, height (0 for any).
+      ! C prototype:
+      !   int pipe_subscribed(int pipe_num, int *width, int *height);
+
+      function pipe_subscribed(pipe_num, width, height) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: pipe_subscribed
+          integer(c_int), value, intent(in) :: pipe_num
+          integer(c_int), intent(out) :: width, height
+      end function pipe_subscribed
+
+      ! Unregister all fields and stop the sampler thread
+      ! C prototype:
+      !   void stop_field_sampler();
+
+      subroutine stop_field_sampler() bind(c)
+          use iso_c_binding
+          implicit none
+      end subroutine stop_field_sampler
+
+      ! Stop the command reader thread (see start_command_reader)
+      ! C prototype:
+      !   void stop_command_reader();
+
+      subroutine stop_command_reader() bind(c)
+          use iso_c_binding
+          implicit none
+      end subroutine stop_command_reader
+
+      ! Enable (enable /= 0) or disable tracing of image frames (also enabled by the environment variable FIFO_TRACE=1).
+      ! Each image is followed by a line "trace:seq start encoded written" (for fifofum.py --trace=file.json)
+      ! C prototype:
+      !   void set_fifo_trace(int enable);
+
+      subroutine set_fifo_trace(enable) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int), value, intent(in) :: enable
+      end subroutine set_fifo_trace
+
+      ! Mark the start of the next traced frame of pipe (e.g., before quantizing; no-op if tracing is disabled)
+      ! C prototype:
+      !   void trace_frame_start(int pipe_num);
+
+      subroutine trace_frame_start(pipe_num) bind(c)
+          use iso_c_binding
+          implicit none
+          integer(c_int), value, intent(in) :: pipe_num
+      end subroutine trace_frame_start
+
    end interface
 
    interface
@@ -171,6 +285,14 @@ module fifo_f
           integer(c_int), value, intent(in) :: encoding, named_pipe
       end function tem_allocate_file_pipe
 
+      function tem_allocate_mmap_pipe(path, encoding, max_frame_bytes) bind(c, name="allocate_mmap_pipe")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_allocate_mmap_pipe
+          character(kind=c_char), intent(in) :: path(*)
+          integer(c_int), value, intent(in) :: encoding, max_frame_bytes
+      end function tem_allocate_mmap_pipe
+
       function tem_open_read_fd(path) bind(c, name="open_read_fd")
           use iso_c_binding
           implicit none
@@ -178,6 +300,111 @@ module fifo_f
           character(kind=c_char), intent(in) :: path(*)
       end function tem_open_read_fd
 
+      function tem_start_fifo_server(addr, port) bind(c, name="start_fifo_server")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_start_fifo_server
+          character(kind=c_char), intent(in) :: addr(*)
+          integer(c_int), value, intent(in) :: port
+      end function tem_start_fifo_server
+
+      function tem_allocate_server_pipe(name) bind(c, name="allocate_server_pipe")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_allocate_server_pipe
+          character(kind=c_char), intent(in) :: name(*)
+      end function tem_allocate_server_pipe
+
+      function tem_allocate_socket_pipe(path) bind(c, name="allocate_socket_pipe")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_allocate_socket_pipe
+          character(kind=c_char), intent(in) :: path(*)
+      end function tem_allocate_socket_pipe
+
+      function tem_write_tile_header(pipe_num, name, seq, x_offset, y_offset, width, height, &
+                                     global_width, global_height) bind(c, name="write_tile_header")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_write_tile_header
+          character(kind=c_char), intent(in) :: name(*)
+          integer(c_int), value, intent(in) :: pipe_num, seq, x_offset, y_offset, width, height
+          integer(c_int), value, intent(in) :: global_width, global_height
+      end function tem_write_tile_header
+
+      function tem_quantize_field(data, elem_size, width, height, min_value, max_value, scale_mode, clip_percent, &
+                                  linthresh, levels, check_undef, undef_value, img, data_min, data_max, &
+                                  range_min, range_max) bind(c, name="quantize_field")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_quantize_field
+          type(*), intent(in) :: data(*)
+          integer(c_int), value, intent(in) :: elem_size, width, height, scale_mode, levels, check_undef
+          real(c_double), value, intent(in) :: min_value, max_value, clip_percent, linthresh, undef_value
+          character(kind=c_char), intent(out) :: img(*)
+          real(c_double), intent(out) :: data_min, data_max, range_min, range_max
+      end function tem_quantize_field
+
+      function tem_set_field_scaling(field_id, scale_mode, clip_percent, linthresh) bind(c, name="set_field_scaling")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_set_field_scaling
+          integer(c_int), value, intent(in) :: field_id, scale_mode
+          real(c_double), value, intent(in) :: clip_percent, linthresh
+      end function tem_set_field_scaling
+
+      function tem_encode_field16(pipe_num, data, elem_size, width, height, min_value, max_value, &
+                                  check_undef, undef_value) bind(c, name="encode_field16")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_encode_field16
+          integer(c_int), value, intent(in) :: pipe_num, elem_size, width, height, check_undef
+          type(*), intent(in) :: data(*)
+          real(c_double), value, intent(in) :: min_value, max_value, undef_value
+      end function tem_encode_field16
+
+      function tem_write_series(pipe_num, name, count, t, values) bind(c, name="write_series")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_write_series
+          integer(c_int), value, intent(in) :: pipe_num, count
+          character(kind=c_char), intent(in) :: name(*)
+          real(c_double), intent(in) :: t(*), values(*)
+      end function tem_write_series
+
+      function tem_start_command_reader(path) bind(c, name="start_command_reader")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_start_command_reader
+          character(kind=c_char), intent(in) :: path(*)
+      end function tem_start_command_reader
+
+      function tem_fifo_poll_command(buf, maxlen) bind(c, name="fifo_poll_command")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_fifo_poll_command
+          character(kind=c_char), intent(out) :: buf(*)
+          integer(c_int), value, intent(in) :: maxlen
+      end function tem_fifo_poll_command
+
+      function tem_update_subscriptions(line) bind(c, name="update_subscriptions")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_update_subscriptions
+          character(kind=c_char), intent(in) :: line(*)
+      end function tem_update_subscriptions
+
+      function tem_register_field(pipe_num, data, elem_size, width, height, label, &
+                                  min_value, max_value, colormap_code, interval) bind(c, name="register_field")
+          use iso_c_binding
+          implicit none
+          integer(c_int) :: tem_register_field
+          type(c_ptr), value, intent(in) :: data
+          character(kind=c_char), intent(in) :: label(*)
+          integer(c_int), value, intent(in) :: pipe_num, elem_size, width, height, colormap_code
+          real(c_double), value, intent(in) :: min_value, max_value, interval
+      end function tem_register_field
+
    end interface
 
 contains
@@ -270,6 +497,7 @@ contains
   !                  B64_LINE_ENC  (-1) for Base64, broken into 80 character lines
   !                  GRAPHTERM_ENC (-2) for Base64 with GraphTerm prefix and suffix
   ! If named_pipe, a FIFO file is opened (if needed) and kept open even after data is output. (=1 by DEFAULT)
+  ! Otherwise (named_pipe=0), the file always contains the latest complete frame, published by atomic rename.
   ! C prototype:
   ! int allocate_file_pipe(const char *path, int encoding, int named_pipe);
 
@@ -297,6 +525,28 @@ contains
       allocate_file_pipe = tem_allocate_file_pipe(c_path, tem_encoding, tem_named_pipe)
     end function allocate_file_pipe
 
+  ! Create double-buffered memory-mapped file, containing the latest frame, for local readers polling at high rates,
+  ! returning pipe number (>= 0) on success or negative value on error.
+  ! Frames larger than max_frame_bytes (DEFAULT 4 MB) are dropped. encoding defaults to DATA_URL_ENC.
+  ! C prototype:
+  !   int allocate_mmap_pipe(const char *path, int encoding, int max_frame_bytes);
+
+  function allocate_mmap_pipe(path, encoding, max_frame_bytes)
+      implicit none
+      integer :: allocate_mmap_pipe
+      character(len=*), intent(in) :: path
+      integer, OPTIONAL, intent(in) :: encoding, max_frame_bytes
+      character(len=len_trim(path)+1,kind=c_char) :: c_path
+
+      integer :: tem_encoding=DATA_URL_ENC, tem_max_frame_bytes=4194304
+
+      if (present(encoding)) tem_encoding = encoding
+      if (present(max_frame_bytes)) tem_max_frame_bytes = max_frame_bytes
+
+      c_path = trim(path)//c_null_char
+      allocate_mmap_pipe = tem_allocate_mmap_pipe(c_path, tem_encoding, tem_max_frame_bytes)
+  end function allocate_mmap_pipe
+
   ! Create and open named pipe for reading, returning file descriptor (>= 0)
   ! C prototype:
   !   int open_read_fd(const char *path);
@@ -311,6 +561,221 @@ contains
       open_read_fd = tem_open_read_fd(c_path)
   end function open_read_fd
 
+  ! Start embedded HTTP/WebSocket server thread (fifo_c.c must be compiled with -DFIFO_SERVER),
+  ! listening on addr:port (DEFAULT 127.0.0.1:8008), so that output can be viewed without fifofum.py.
+  ! Returns 0 on success, or -1 on error.
+  ! C prototype:
+  !   int start_fifo_server(const char *addr, int port);
+
+  function start_fifo_server(addr, port)
+      implicit none
+      integer :: start_fifo_server
+      character(len=*), OPTIONAL, intent(in) :: addr
+      integer, OPTIONAL, intent(in) :: port
+
+      character(len=64,kind=c_char) :: c_addr
+      integer :: tem_port=8008
+
+      if (present(port)) tem_port = port
+
+      if (present(addr)) then
+          c_addr = trim(addr)//c_null_char
+      else
+          c_addr = c_null_char
+      endif
+      start_fifo_server = tem_start_fifo_server(c_addr, tem_port)
+  end function start_fifo_server
+
+  ! Allocate pipe whose output is streamed by the embedded server (call start_fifo_server first),
+  ! returning pipe number (>= 0) on success or negative value on error.
+  ! Output is displayed in the channel name (DEFAULT "pipe"), unless switched by a "channel:" directive line.
+  ! C prototype:
+  !   int allocate_server_pipe(const char *name);
+
+  function allocate_server_pipe(name)
+      implicit none
+      integer :: allocate_server_pipe
+      character(len=*), OPTIONAL, intent(in) :: name
+      character(len=65,kind=c_char) :: c_name
+
+      if (present(name)) then
+          c_name = trim(name)//c_null_char
+      else
+          c_name = c_null_char
+      endif
+      allocate_server_pipe = tem_allocate_server_pipe(c_name)
+  end function allocate_server_pipe
+
+  ! Allocate pipe that listens on the Unix domain socket path, accepting any number of local readers
+  ! (fifo_c.c must be compiled with -DFIFO_SERVER). Output is encoded as for DATA_URL_ENC.
+  ! Each frame is encoded once and shared by all readers; readers that fall behind skip stale frames.
+  ! Returns pipe number (>= 0) on success or negative value on error.
+  ! C prototype:
+  !   int allocate_socket_pipe(const char *path);
+
+  function allocate_socket_pipe(path)
+      implicit none
+      integer :: allocate_socket_pipe
+      character(len=*), intent(in) :: path
+      character(len=len_trim(path)+1,kind=c_char) :: c_path
+
+      c_path = trim(path)//c_null_char
+      allocate_socket_pipe = tem_allocate_socket_pipe(c_path)
+  end function allocate_socket_pipe
+
+  ! Register a 2-dimensional real data field to be plotted every interval seconds (DEFAULT 1.0)
+  ! by a background sampler thread (fifo_c.c must be compiled with -DFIFO_THREADS or -DFIFO_SERVER),
+  ! so that no plot calls are needed in the time loop (see fifo_safe_point).
+  ! label, colormap_code, min_value:max_value, scale_mode, clip_percent and linthresh are as for fifo_plot2d
+  ! (scale_mode, clip_percent and linthresh may be changed later using set_field_scaling).
+  ! The sampler reads field directly, so the actual argument must be a whole contiguous TARGET (or allocatable)
+  ! array that remains allocated until unregister_field/stop_field_sampler is called; array sections are
+  ! rejected (the compiler would pass a temporary copy, freed on return).
+  ! Returns field id (>= 0) on success, or -1 on error.
+  ! C prototype:
+  !   int register_field(int pipe_num, const void *data, int elem_size, int width, int height, const char *label,
+  !                      double min_value, double max_value, int colormap_code, double interval);
+
+  function register_field(pipe_num, field, label, colormap_code, min_value, max_value, interval, scale_mode, clip_percent, &
+                          linthresh)
+      implicit none
+      integer :: register_field
+      integer, intent(in) :: pipe_num
+      real, target, intent(in) :: field(:,:)
+      character(len=*), OPTIONAL, intent(in) :: label
+      integer, OPTIONAL, intent(in) :: colormap_code, scale_mode
+      real, OPTIONAL, intent(in) :: min_value, max_value, interval, clip_percent, linthresh
+
+      character(len=81,kind=c_char) :: c_label
+      integer :: tem_colormap_code, tem_scale_mode
+      real(c_double) :: tem_min_value, tem_max_value, tem_interval, tem_clip_percent, tem_linthresh
+
+      if (.not. is_contiguous(field)) then
+          call stderr("register_field: ERROR field must be a whole contiguous array, not an array section")
+          register_field = -1
+          return
+      end if
+
+      c_label = c_null_char
+      if (present(label)) c_label = trim(label)//c_null_char
+      tem_colormap_code = 0
+      if (present(colormap_code)) tem_colormap_code = colormap_code
+      tem_min_value = 0.0
+      tem_max_value = 0.0
+      if (present(min_value) .and. present(max_value)) then
+          tem_min_value = min_value
+          tem_max_value = max_value
+      end if
+      tem_interval = 1.0
+      if (present(interval)) tem_interval = interval
+
+      register_field = tem_register_field(pipe_num, c_loc(field), storage_size(field)/8, size(field,1), size(field,2), &
+                                          c_label, tem_min_value, tem_max_value, tem_colormap_code, tem_interval)
+
+      if (register_field >= 0 .and. (present(scale_mode) .or. present(clip_percent) .or. present(linthresh))) then
+          tem_scale_mode = LINEAR_SCALE
+          if (present(scale_mode)) tem_scale_mode = scale_mode
+          tem_clip_percent = 0.0
+          if (present(clip_percent)) tem_clip_percent = clip_percent
+          tem_linthresh = 0.0
+          if (present(linthresh)) tem_linthresh = linthresh
+          if (tem_set_field_scaling(register_field, tem_scale_mode, tem_clip_percent, tem_linthresh) < 0) &
+              call stderr("register_field: ERROR in setting scaling")
+      end if
+  end function register_field
+
+  ! Set the scale_mode, clip_percent and linthresh (see fifo_plot2d; DEFAULT 0 for default threshold)
+  ! of a registered field, returning 0 on success, or -1 on error.
+  ! C prototype:
+  !   int set_field_scaling(int field_id, int scale_mode, double clip_percent, double linthresh);
+
+  function set_field_scaling(field_id, scale_mode, clip_percent, linthresh)
+      implicit none
+      integer :: set_field_scaling
+      integer, intent(in) :: field_id, scale_mode
+      real(c_double), intent(in) :: clip_percent
+      real(c_double), OPTIONAL, intent(in) :: linthresh
+      real(c_double) :: tem_linthresh
+
+      tem_linthresh = 0.0
+      if (present(linthresh)) tem_linthresh = linthresh
+      set_field_scaling = tem_set_field_scaling(field_id, scale_mode, clip_percent, tem_linthresh)
+  end function set_field_scaling
+
+  ! Process a "fifo:subscribe ..." control line received from the viewer via the input pipe, listing the
+  ! channels open in any browser tab (with requested resolution). Images for channels without subscribers
+  ! are then skipped by encode_image/fifo_plot2d (and downsampled to the requested resolution otherwise).
+  ! Returns 1 if line was a subscription line (and should not be processed further), or 0 otherwise.
+  ! C prototype:
+  !   int update_subscriptions(const char *line);
+
+  function update_subscriptions(line)
+      implicit none
+      integer :: update_subscriptions
+      character(len=*), intent(in) :: line
+      character(len=len(line)+1,kind=c_char) :: c_line
+
+      c_line = line//c_null_char
+      update_subscriptions = tem_update_subscriptions(c_line)
+  end function update_subscriptions
+
+  ! Start background thread reading command lines from named pipe path (created, if need be),
+  ! or from Unix domain socket path, returning 0 on success, or -1 on error (requires -DFIFO_THREADS).
+  ! Lines starting with "fifo:" are processed as control lines (see update_subscriptions).
+  ! C prototype:
+  !   int start_command_reader(const char *path);
+
+  function start_command_reader(path)
+      implicit none
+      integer :: start_command_reader
+      character(len=*), intent(in) :: path
+      character(len=len_trim(path)+1,kind=c_char) :: c_path
+
+      c_path = trim(path)//c_null_char
+      start_command_reader = tem_start_command_reader(c_path)
+  end function start_command_reader
+
+  ! Retrieve next command line queued by the command reader thread into command (blank padded),
+  ! returning its length, or 0 if no command is available. Never blocks or makes a system call,
+  ! and may be called every time step.
+  ! C prototype:
+  !   int fifo_poll_command(char *buf, int maxlen);
+
+  function fifo_poll_command(command)
+      implicit none
+      integer :: fifo_poll_command
+      character(len=*), intent(out) :: command
+      character(kind=c_char) :: c_buf(len(command)+1)
+      integer :: j
+
+      command = ' '
+      fifo_poll_command = tem_fifo_poll_command(c_buf, len(command)+1)
+      do j = 1, fifo_poll_command
+          command(j:j) = c_buf(j)
+      end do
+  end function fifo_poll_command
+
+  ! Append sample (t, value) to scalar time series name (no colons or spaces) of the current channel,
+  ! returning number of bytes written, or -1 on error. The series is written as a compact binary directive line,
+  ! and plotted by fifofum.py (with the whole history decimated to a bounded number of points).
+  ! C prototype:
+  !   int write_series(int pipe_num, const char *name, int count, const double *t, const double *values);
+
+  function write_series(pipe_num, name, t, value)
+      implicit none
+      integer :: write_series
+      integer, intent(in) :: pipe_num
+      character(len=*), intent(in) :: name
+      real, intent(in) :: t, value
+      character(len=len_trim(name)+1,kind=c_char) :: c_name
+      real(c_double) :: c_t(1), c_value(1)
+
+      c_name = trim(name)//c_null_char
+      c_t(1) = t
+      c_value(1) = value
+      write_series = tem_write_series(pipe_num, c_name, 1, c_t, c_value)
+  end function write_series
+
   ! Write string to pipe, returning number of bytes written, or -1 on error,
   ! optionally ending the line by appending a new_line character (end_line=1).
   ! If encoded=1, write encoded data.
@@ -350,11 +815,27 @@ contains
   ! undef_color/transp_color can be a basic color (0-15), or a color in the colormap (16-255).
   ! If transp_color or undef_color is specified, it will also be used for out-of-range plot values.
   ! colors is an optional colormap array (as in encode_image)
+  ! If the current channel of the pipe has no subscribers (see update_subscriptions), nothing is plotted
+  ! (unless global_shape is specified, because tiles must always be written), and 0 is returned.
+  ! If levels > 1, values are quantized to that many discrete levels, evenly spaced across the colormap
+  ! (frames with fewer colors, and long runs of the same color, compress much better).
+  ! scale_mode = LINEAR_SCALE (DEFAULT), LOG_SCALE (e.g., for precipitation; non-positive values use the first color,
+  ! or out-of-range color), or SYMLOG_SCALE (logarithmic for both signs, linear within linthresh of zero;
+  ! DEFAULT linthresh is 1/1000 of the largest magnitude of the range, e.g., use the noise floor of the field instead).
+  ! If clip_percent > 0, the range is determined by the clip_percent and 100-clip_percent percentiles of the field
+  ! (estimated from a sample), instead of the extreme values. With nonlinear scale_mode or clip_percent, values are
+  ! mapped to colors in C (using a table of breakpoints, without a transcendental function call per value), and
+  ! min_value and max_value must both be specified to override the range determined from the data.
+  ! If global_shape is specified, field is plotted as a tile of a larger global field (e.g., the subdomain
+  ! of an MPI rank), with tile_offset (0-based, default 0) giving the offset of field(1,1) in the global field.
+  ! fifofum.py stitches tiles with the same tile_name (default "tiles") and tile_seq into one image.
+  ! (tile_seq defaults to a per-pipe counter; specify min_value/max_value so that all tiles use the same scale.)
   !
   ! Basic colors 0-7:   Black,  White,     Red,  Lime Green,  Blue,  Cyan,  Magenta,  Yellow
   ! basic colors 8-15: Silver,   Gray,  Maroon,  Dark Green,  Navy,  Teal,   Purple,   Olive
   function fifo_plot2d(pipe_num, field, label, colormap_code, opacity, min_value, max_value, &
-                       undef_value, undef_color, transp_color, colors)
+                       undef_value, undef_color, transp_color, colors, &
+                       tile_name, tile_seq, tile_offset, global_shape, levels, scale_mode, clip_percent, linthresh)
       use iso_c_binding
       implicit none
       integer fifo_plot2d
@@ -365,8 +846,14 @@ contains
       real, OPTIONAL, intent(in) :: opacity,  min_value, max_value, undef_value
       integer, OPTIONAL, intent(in) :: undef_color, transp_color
       integer(c_int), OPTIONAL, intent(in) :: colors(1:,1:)
+      character(len=*), OPTIONAL, intent(in) :: tile_name
+      integer, OPTIONAL, intent(in) :: tile_seq, tile_offset(2), global_shape(2)
+      integer, OPTIONAL, intent(in) :: levels, scale_mode
+      real, OPTIONAL, intent(in) :: clip_percent, linthresh
 
       integer, parameter :: BASIC_COLORS=16, MAX_COLORS=256
+      character(len=65,kind=c_char) :: c_tile_name
+      integer :: tem_tile_seq, tem_tile_offset(2)
 
       integer :: colormap(3,MAX_COLORS), reverse=0, n_colors=MAX_COLORS-BASIC_COLORS
       integer :: alphas(256), n_alphas=0
@@ -374,14 +861,35 @@ contains
       character(len=81) :: line_buf, line_buf2
       real :: field_min, field_max, plot_min, plot_max, plot_scale
       integer :: status, field_sec, i, igray
+      integer(c_int) :: req_width, req_height
 
       integer :: tem_colormap_code=0, tem_undef_color=0, tem_transp_color=-1, out_of_range_color=-1
+      integer :: tem_levels, tem_scale_mode
       real :: tem_opacity = 1.0
+      real(c_double) :: c_min_value, c_max_value, c_clip_percent, c_linthresh, c_undef_value
+      real(c_double) :: c_data_min, c_data_max, c_range_min, c_range_max
+      real, allocatable :: field_copy(:,:)
+
+      if (.not. present(global_shape)) then
+          if (pipe_subscribed(pipe_num, req_width, req_height) == 0) then
+              fifo_plot2d = 0
+              return
+          end if
+      end if
+      call trace_frame_start(pipe_num)
 
       if (present(colormap_code)) tem_colormap_code = max(-3,min(3,colormap_code))
       if (present(opacity)) tem_opacity = max(0.0,min(1.0,opacity))
       if (present(undef_color)) tem_undef_color = max(0,min(255,undef_color))
       if (present(transp_color)) tem_transp_color = max(-1,min(255,transp_color))
+      tem_levels = 0
+      if (present(levels)) tem_levels = max(0,min(n_colors,levels))
+      tem_scale_mode = LINEAR_SCALE
+      if (present(scale_mode)) tem_scale_mode = scale_mode
+      c_clip_percent = 0.0
+      if (present(clip_percent)) c_clip_percent = max(0.0,min(50.0,clip_percent))
+      c_linthresh = 0.0
+      if (present(linthresh)) c_linthresh = linthresh
 
       if (tem_transp_color >= 0) then
          out_of_range_color = tem_transp_color
@@ -430,6 +938,44 @@ contains
          n_alphas = 0
       end if
 
+      if (tem_scale_mode /= LINEAR_SCALE .or. c_clip_percent > 0.0) then
+          ! Nonlinear scaling and/or percentile range, using breakpoint table in C
+          c_min_value = 0.0
+          c_max_value = 0.0
+          if (present(min_value) .and. present(max_value)) then
+              c_min_value = min_value
+              c_max_value = max_value
+          end if
+          c_undef_value = 0.0
+          if (present(undef_value)) c_undef_value = undef_value
+          if (is_contiguous(field)) then
+              status = tem_quantize_field(field, storage_size(field)/8, size(field,1), size(field,2), c_min_value, &
+                                          c_max_value, tem_scale_mode, c_clip_percent, c_linthresh, tem_levels, &
+                                          merge(1,0,present(undef_value)), c_undef_value, field_pixels, &
+                                          c_data_min, c_data_max, c_range_min, c_range_max)
+          else
+              ! Array section (e.g., compute domain without halo): C needs a contiguous copy
+              allocate(field_copy(size(field,1), size(field,2)))
+              field_copy(:,:) = field
+              status = tem_quantize_field(field_copy, storage_size(field)/8, size(field,1), size(field,2), c_min_value, &
+                                          c_max_value, tem_scale_mode, c_clip_percent, c_linthresh, tem_levels, &
+                                          merge(1,0,present(undef_value)), c_undef_value, field_pixels, &
+                                          c_data_min, c_data_max, c_range_min, c_range_max)
+          end if
+          field_min = real(c_data_min)
+          field_max = real(c_data_max)
+          plot_min = real(c_range_min)
+          plot_max = real(c_range_max)
+
+          ! Values outside a range derived from the data (e.g., percentile tails) saturate the colormap
+          if (out_of_range_color >= 0 .and. present(min_value) .and. present(max_value)) then
+              where(field < plot_min .or. field > plot_max) field_pixels = char(out_of_range_color)
+          end if
+          if (present(undef_value)) then
+              where(field == undef_value) field_pixels = char(tem_undef_color)
+          end if
+
+      else
       ! find max/min of field and scale it
       if (present(undef_value)) then
           if (count(field /= undef_value) == 0) then
@@ -468,21 +1014,22 @@ contains
           elsewhere(field < plot_min .or. field > plot_max)
              field_pixels = char(out_of_range_color)
           elsewhere
-             field_pixels = char( BASIC_COLORS + max(0,min(255,nint( (field - plot_min) * plot_scale))) )
+             field_pixels = char( BASIC_COLORS + color_index(field, plot_min, plot_scale, n_colors, tem_levels) )
           endwhere
       else if (out_of_range_color >= 0) then
           where(field < plot_min .or. field > plot_max)
              field_pixels = char(out_of_range_color)
           elsewhere
-             field_pixels = char( BASIC_COLORS + max(0,min(255,nint( (field - plot_min) * plot_scale))) )
+             field_pixels = char( BASIC_COLORS + color_index(field, plot_min, plot_scale, n_colors, tem_levels) )
           endwhere
       else
-          field_pixels = char( BASIC_COLORS + max(0,min(255,nint( (field - plot_min) * plot_scale))) )
+          field_pixels = char( BASIC_COLORS + color_index(field, plot_min, plot_scale, n_colors, tem_levels) )
+      end if
       end if
 
       if (present(label)) then
           write(line_buf, '(a,g12.5,a,g12.5)') " Max=", plot_max, ", Min=", plot_min
-          if (present(min_value) .or. present(max_value)) then
+          if (present(min_value) .or. present(max_value) .or. c_clip_percent > 0.0) then
              write(line_buf2, '(a,g12.5,a,g12.5)') ", DataMax=", field_max, ", DataMin=", field_min
           else
              line_buf2 = ""
@@ -490,6 +1037,18 @@ contains
           status = write_str_to_pipe(pipe_num, label//trim(line_buf)//trim(line_buf2), end_line=1)
       end if
 
+      if (present(global_shape)) then
+          ! Tile directive for the image that follows
+          c_tile_name = c_null_char
+          if (present(tile_name)) c_tile_name = trim(tile_name)//c_null_char
+          tem_tile_seq = -1
+          if (present(tile_seq)) tem_tile_seq = tile_seq
+          tem_tile_offset = 0
+          if (present(tile_offset)) tem_tile_offset = tile_offset
+          status = tem_write_tile_header(pipe_num, c_tile_name, tem_tile_seq, tem_tile_offset(1), tem_tile_offset(2), &
+                                         size(field,1), size(field,2), global_shape(1), global_shape(2))
+      end if
+
       if (present(colors)) then
           ! User-defined colormap
           if (size(colors,1) /= 3) call stderr("fifo_plot2d: ERROR colors must be a 3x256 array", exit=1)
@@ -501,6 +1060,79 @@ contains
 
       fifo_plot2d = status
   end function fifo_plot2d
+
+  ! Send a 2-dimensional real data field quantized to 16 bits (65535 levels), for display in the browser,
+  ! where the colormap, range and opacity can be changed interactively (without re-encoding),
+  ! and the data value under the pointer is displayed.
+  ! min_value:max_value spans the quantized range (values outside are clipped). If omitted, they are determined
+  ! from the data. Values equal to undef_value (and NaN values) are transparent.
+  ! If the current channel of the pipe has no subscribers, nothing is sent (not even the label), and 0 is returned.
+  ! C prototype:
+  !   int encode_field16(int pipe_num, const void *data, int elem_size, int width, int height,
+  !                      double min_value, double max_value, int check_undef, double undef_value);
+
+  function fifo_field2d(pipe_num, field, label, min_value, max_value, undef_value)
+      use, intrinsic :: ieee_arithmetic
+      implicit none
+      integer fifo_field2d
+      integer, intent(in) :: pipe_num
+      real, intent(in) :: field(:,:)
+      character(len=*), OPTIONAL, intent(in) :: label
+      real, OPTIONAL, intent(in) :: min_value, max_value, undef_value
+
+      real(c_double) :: tem_min_value, tem_max_value, tem_undef_value
+      integer(c_int) :: check_undef, status, req_width, req_height
+      real, allocatable :: field_copy(:,:)
+
+      if (pipe_subscribed(pipe_num, req_width, req_height) == 0) then
+          fifo_field2d = 0
+          return
+      end if
+
+      tem_min_value = ieee_value(tem_min_value, ieee_quiet_nan)
+      tem_max_value = tem_min_value
+      tem_undef_value = 0.0
+      check_undef = 0
+      if (present(min_value)) tem_min_value = min_value
+      if (present(max_value)) tem_max_value = max_value
+      if (present(undef_value)) then
+          tem_undef_value = undef_value
+          check_undef = 1
+      end if
+
+      if (present(label)) status = write_str_to_pipe(pipe_num, label, end_line=1)
+
+      if (is_contiguous(field)) then
+          fifo_field2d = tem_encode_field16(pipe_num, field, storage_size(field)/8, size(field,1), size(field,2), &
+                                            tem_min_value, tem_max_value, check_undef, tem_undef_value)
+      else
+          ! Array section: C needs a contiguous copy
+          allocate(field_copy(size(field,1), size(field,2)))
+          field_copy(:,:) = field
+          fifo_field2d = tem_encode_field16(pipe_num, field_copy, storage_size(field)/8, size(field,1), size(field,2), &
+                                            tem_min_value, tem_max_value, check_undef, tem_undef_value)
+      end if
+  end function fifo_field2d
+
+  ! Colormap index (0 to n_colors-1) for value scaled by plot_scale,
+  ! optionally quantized to levels discrete levels (levels > 1)
+  elemental function color_index(value, plot_min, plot_scale, n_colors, levels)
+      implicit none
+      integer :: color_index
+      real, intent(in) :: value, plot_min, plot_scale
+      integer, intent(in) :: n_colors, levels
+
+      real :: scaled
+      integer :: level
+
+      scaled = max(0.0, min(real(n_colors-1), (value - plot_min) * plot_scale))
+      if (levels > 1) then
+          level = min(levels-1, int(scaled * levels / (n_colors-1)))
+          color_index = nint( level * real(n_colors-1) / (levels-1) )
+      else
+          color_index = nint(scaled)
+      end if
+  end function color_index
       
   ! From: fortranwiki.org
   subroutine stderr(message, exit)
@@ -4,10 +4,17 @@
 """
 fifofum: FIFO pipe server
 
-Usage: python fifofum.py [--addr=...] [--port=...] [--multiplex=1] [--passthru=1] [--input=pipe0.fifo] pipe1.fifo ...
+Usage: python fifofum.py [--addr=...] [--port=...] [--multiplex=1] [--passthru=1] [--compress=N] [--trace=file.json] [--input=pipe0.fifo [--subscribe=1]] pipe1.fifo ...
 
 Specifying "-" or "_" as pipe name uses stdin for input and/or stdout for output
 
+A pipe name may also be a Unix domain socket created by allocate_socket_pipe (fifo_c.c compiled with -DFIFO_SERVER).
+Any number of readers may connect to such a socket, and the connection is retried if the writer restarts.
+
+A pipe name may also be a regular file, containing the latest frame, written by allocate_file_pipe with named_pipe=0,
+or a double-buffered memory-mapped file created by allocate_mmap_pipe. Such files are polled for new frames
+(every --poll seconds).
+
 Streams PNG images and text from named pipes created by fifopiper.c via a browser.
 Newline terminated printable text should be written to the pipe.
 Images should be output as data URLs terminated by newlines ("data:image/png;base64,...\n").
@@ -15,12 +22,40 @@ Images should be output as data URLs terminated by newlines ("data:image/png;bas
 Different pipes are treated as different channels, named using the basename of the FIFO file.
 Each channel is displayed separately.
 
+Channels can be hidden in the browser. If --input and --subscribe=1 are specified, the set of channels open in any
+browser tab (with the display resolution) is written to the input pipe as a control line of the form
+"fifo:subscribe *=0x0 name1=WxH name2=- ...\n", so that the program can skip encoding channels nobody is viewing
+(the program must pass such lines to update_subscriptions in fifo_c.c, instead of treating them as input).
+When no browser is connected, the channels seen so far are listed as "-" (other channels are still encoded).
+
 For multiplexed pipes, a directive line of the form "channel: name\n" is used to switch channels within a pipe.
 (The multiplex option may be useful even for a single channel, if blocks of output lines always need to be
 processed together, because lines are skipped initially until the channel directive is encountered.)
 
+A directive line of the form "series:name base64\n" (see write_series in fifo_c.c) appends (t, value) samples to
+the scalar time series name of the channel. The whole history of each series is kept as a pyramid of min/max buckets,
+and a decimated copy (at most --series_points points, selected using min/max buckets and largest-triangle-three-buckets)
+is plotted in the browser, updated at most every --series_interval seconds. Viewers connecting later receive the
+whole history at once.
+
+A directive line of the form "tile: name seq x y width height global_width global_height\n" (see write_tile_header in fifo_c.c)
+marks the next image as a tile of a larger image. Tiles with the same name and sequence number, from any number of pipes
+(e.g., one per MPI rank), are stitched together and displayed in the channel name once the whole image is covered.
+
 --passthru option "pipes" non-image output data to standard output (for logging)
 
+--compress=N starts N worker processes that compress raw images ("data:image/x-raw;base64,...", written by fifo_c.c
+compiled with -DFIFO_NO_PNG) to PNG, so that the program avoids the cost of PNG encoding, but browsers still receive
+compressed images. Messages of each channel are broadcast in order (waiting for images being compressed), and the
+PNG images of unchanged frames are cached. The latest image of each channel is sent to newly connected browsers.
+
+--trace=file.json records the timings of image frames as Chrome trace events (viewable in Perfetto or chrome://tracing).
+When tracing is enabled in fifo_c.c (set_fifo_trace, or the environment variable FIFO_TRACE=1), each image is followed by a
+directive line "trace:seq start encoded written\n" with CLOCK_MONOTONIC times in microseconds. fifofum.py adds the times
+when the line started to arrive, was complete and was broadcast, and browsers return the times when the image was received,
+decoded and painted (mapped to the same clock). Each channel is shown as a process, with the library, fifofum.py and each
+browser as threads. Trace lines are never passed through.
+
 --background specifies the URL of a background image. The image should cover exactly the same domain as the data being plotted.
   For example, if using cyclindrical projection over the whole globe, the NASA Blue Marble image can be used as the background
   --background=http://eoimages.gsfc.nasa.gov/images/imagerecords/74000/74092/world.200407.3x5400x2700.jpg
@@ -36,26 +71,49 @@ from tornado.options import define, options, parse_command_line
 
 from tornado import httpserver, ioloop, web, websocket
 
+import array
+import base64
+import collections
+import ctypes
 import fcntl
 import functools
+import hashlib
 import json
 import logging
+import mmap
+import multiprocessing
 import os
 import os.path
+import signal
+import socket
+import stat
+import struct
 import sys
 import time
+import zlib
 
 Doc_rootdir = os.path.join(os.path.dirname(__file__), "www")
+Field16_js_path = os.path.join(os.path.dirname(__file__), "field16.js")
 
 Web_sockets = []
 Pipes = {}
+Tiles = {}
+Series = {}
+Channels = {}
+Last_images = {}
+Compress_pool = None
+Compress_cache = collections.OrderedDict()
+Tracer = None
 Input_pipe = None
+Subscriptions_line = ""
+Field16_script = ""
 
 Index_html = """
 <!DOCTYPE html>
 <html>
 <head>
 <title>FIFO pipe server</title>
+<script src="/field16.js"></script>
 <script>
     var displayInputBox = %(input_box)s;  // SUBSTITUTE
     var imageBackground = '%(image_background)s';  // SUBSTITUTE
@@ -67,23 +125,51 @@ Index_html = """
 
         var div = document.createElement("div");
         div.id = "div_"+pipeName;
-        div.innerHTML = "<p><h3>"+pipeName+" output<\h3>";
+        div.innerHTML = "<p><h3>"+pipeName+' output <input type="checkbox" class="fifo-show" checked><\h3>';
         container.appendChild(div);
 
+        var body = document.createElement("div");
+        div.appendChild(body);
+
+        // Unchecking hides the channel, which is then no longer encoded (unless open in another tab)
+        var show = div.getElementsByClassName("fifo-show")[0];
+        show.name = pipeName;
+        show.onchange = function() {
+            body.style.display = show.checked ? "" : "none";
+            sendSubscriptions();
+        };
+
         var img = document.createElement("img");
         img.id = "img_"+pipeName;
         img.src = "";
+        img.style.maxWidth = "100%%";
         if (imageBackground) {
            img.style["background-image"] = "url('"+imageBackground+"')";
            img.style["background-size"] = "100%% 100%%";
            }
-        div.appendChild(img);
+        body.appendChild(img);
 
         var pre = document.createElement("div");
         pre.id = "pre_"+pipeName;
         pre.style["white-space"] = "pre-wrap";
         pre.style["font-family"] = "monospace";
-        div.appendChild(pre);
+        body.appendChild(pre);
+
+        sendSubscriptions();
+    }
+
+    function sendSubscriptions() {
+        // Send channels shown in this tab, with display resolution, as "fifo:subscribe name=WxH name2=- ..."
+        if (FIFOsocket.readyState !== 1)
+            return;
+        var scale = window.devicePixelRatio || 1;
+        var res = Math.round(document.getElementById("pipeContainer").clientWidth*scale) + "x" +
+                  Math.round(window.innerHeight*scale);
+        var msg = "fifo:subscribe";
+        var boxes = document.getElementsByClassName("fifo-show");
+        for (var i = 0; i < boxes.length; i++)
+            msg += " " + boxes[i].name + "=" + ((boxes[i].checked && !document.hidden) ? res : "-");
+        FIFOsocket.send(msg);
     }
 
     function sendData() {
@@ -93,6 +179,102 @@ Index_html = """
         FIFOsocket.send(msg);
     }
 
+    function stitch_tiles(pipeName, tileInfo) {
+       // Draws image tiles onto a canvas, displaying the stitched image once all tiles have been loaded
+       var canvas = document.createElement("canvas");
+       canvas.width = tileInfo.width;
+       canvas.height = tileInfo.height;
+       var ctx = canvas.getContext("2d");
+       var remaining = tileInfo.tiles.length;
+
+       tileInfo.tiles.forEach(function(tile) {
+           var img = new Image();
+           img.onload = function() {
+               ctx.drawImage(img, tile.x, tile.y);
+               remaining -= 1;
+               if (!remaining)
+                   document.getElementById("img_"+pipeName).src = canvas.toDataURL("image/png");
+           };
+           if (tile.url.substr(0,rawImagePrefix.length) === rawImagePrefix)
+               img.src = raw_to_png(tile.url.substr(rawImagePrefix.length));
+           else
+               img.src = tile.url;
+       });
+    }
+
+    function plot_series(pipeName, series) {
+       // Plots decimated time series (base64 encoded little-endian float64 t, value pairs) on a canvas
+       var canvasId = "series_"+pipeName+"_"+series.name;
+       var canvas = document.getElementById(canvasId);
+       if (canvas === null) {
+           canvas = document.createElement("canvas");
+           canvas.id = canvasId;
+           canvas.width = 600;
+           canvas.height = 160;
+           canvas.style.display = "block";
+           document.getElementById("img_"+pipeName).parentNode.appendChild(canvas);
+       }
+
+       var raw = window.atob(series.data);
+       var view = new DataView(new ArrayBuffer(raw.length));
+       for (var i = 0; i < raw.length; i++)
+           view.setUint8(i, raw.charCodeAt(i));
+       var n = raw.length / 16;
+       if (!n)
+           return;
+
+       var t = [], v = [];
+       var tmin = Infinity, tmax = -Infinity, vmin = Infinity, vmax = -Infinity;
+       for (var i = 0; i < n; i++) {
+           t.push(view.getFloat64(16*i, true));
+           v.push(view.getFloat64(16*i+8, true));
+           tmin = Math.min(tmin, t[i]); tmax = Math.max(tmax, t[i]);
+           if (isFinite(v[i])) { vmin = Math.min(vmin, v[i]); vmax = Math.max(vmax, v[i]); }
+       }
+       if (tmax === tmin) tmax = tmin + 1;
+       if (!(vmax > vmin)) { vmin -= 0.5; vmax += 0.5; }
+
+       var ctx = canvas.getContext("2d");
+       var w = canvas.width, h = canvas.height, top = 16, bottom = h - 16;
+       ctx.clearRect(0, 0, w, h);
+       ctx.strokeStyle = "#888";
+       ctx.strokeRect(0.5, top+0.5, w-1, bottom-top);
+       ctx.strokeStyle = "#1f77b4";
+       ctx.beginPath();
+       for (var i = 0; i < n; i++) {
+           var x = (t[i]-tmin) / (tmax-tmin) * (w-1);
+           var y = bottom - (v[i]-vmin) / (vmax-vmin) * (bottom-top);
+           if (i) ctx.lineTo(x, y); else ctx.moveTo(x, y);
+       }
+       ctx.stroke();
+
+       ctx.fillStyle = "#000";
+       ctx.font = "11px monospace";
+       ctx.fillText(series.name + " = " + v[n-1].toPrecision(6) + "  (" + series.count + " samples)", 4, 11);
+       ctx.fillText("max " + vmax.toPrecision(4), w-90, 11);
+       ctx.fillText("min " + vmin.toPrecision(4) + "   t " + tmin.toPrecision(6) + " .. " + tmax.toPrecision(6), 4, h-3);
+    }
+
+    /* Frame tracing (fifofum.py --trace): the times when each image is received, decoded and painted are recorded,
+       and returned as 'fifo:trace {...}' once the sequence number of the frame arrives as 'trace:seq' */
+    var traceFrames = {};
+
+    function trace_stamp(frame, stage) {
+        frame[stage] = performance.now();
+        if (stage === "decoded")
+            window.requestAnimationFrame(function() { setTimeout(function() { trace_stamp(frame, "painted"); }, 0); });
+        else
+            trace_report(frame);
+    }
+
+    function trace_report(frame) {
+        if (frame.seq === undefined || frame.painted === undefined || frame.reported)
+            return;
+        frame.reported = true;
+        FIFOsocket.send("fifo:trace " + JSON.stringify({channel: frame.channel, seq: frame.seq, received: frame.received,
+                        decoded: frame.decoded, painted: frame.painted, now: performance.now()}));
+    }
+
     function raw_to_png(b64data) {
        /* Converts raw base64 image pixel data to PNG, returning the data URL
        Raw byte format: width mod 256, width/256, height mod 256, height/256, 256*(r,g,b,a) table, width*height*color_index
@@ -149,8 +331,16 @@ Index_html = """
               if (evt.keyCode==13)
                   document.getElementById('inputButton').click();
             }
+        sendSubscriptions();
     };
 
+    var resizeTimer = null;
+    document.addEventListener("visibilitychange", sendSubscriptions);
+    window.addEventListener("resize", function() {
+        clearTimeout(resizeTimer);
+        resizeTimer = setTimeout(sendSubscriptions, 500);
+    });
+
     var rawImagePrefix = "data:image/x-raw;base64,";
 
     FIFOsocket.onmessage = function(evt){
@@ -166,17 +356,43 @@ Index_html = """
         }
 
         var contentType = content.substr(0,11) === "data:image/" ? "image" : "text"; // Default action is to display text 
+        if (content.substr(0,6) === "tiles:")
+            contentType = "tiles";
+        else if (content.substr(0,7) === "series:")
+            contentType = "series";
+        else if (content.substr(0,6) === "trace:")
+            contentType = "trace";
 
         //console.log("FIFOsocket.onmessage:", pipeName, contentType);
         if (document.getElementById("div_"+pipeName) === null)
             appendPipeElement(pipeName, "pipeContainer");
 
         if (contentType === "image") {
+           var frame = {channel: pipeName, received: performance.now()};
+           var decoded = function() { trace_stamp(frame, "decoded"); };
+           traceFrames[pipeName] = frame;
+           if (content.substr(0,22) === "data:image/png;field16" && typeof field16_image === "function") {
+              field16_image(pipeName, content, decoded);
+              return;
+           }
            if (content.substr(0,rawImagePrefix.length) === rawImagePrefix) {
               // Convert raw image to data URL
               content = raw_to_png(content.substr(rawImagePrefix.length));
            }
-           document.getElementById("img_"+pipeName).src = content;
+           var img = document.getElementById("img_"+pipeName);
+           img.onload = decoded;
+           img.src = content;
+        } else if (contentType === "trace") {
+           // Sequence number of preceding image
+           var traced = traceFrames[pipeName];
+           if (traced && traced.seq === undefined) {
+              traced.seq = parseInt(content.substr(6), 10);
+              trace_report(traced);
+           }
+        } else if (contentType === "tiles") {
+           stitch_tiles(pipeName, JSON.parse(content.substr(6)));
+        } else if (contentType === "series") {
+           plot_series(pipeName, JSON.parse(content.substr(7)));
         } else if (contentType === "text") {
            document.getElementById("pre_"+pipeName).innerHTML = content;
         }
@@ -205,6 +421,56 @@ Index_html = """
 </html>
 """
 
+# Viridis colors of fifo_plot2d (the 240 colors of VIRIDIS_PLUS_CMAP in fifo_c.c), for field16.js
+Field16_viridis = [
+    ( 68,  1, 84), ( 68,  3, 86), ( 69,  4, 87), ( 69,  5, 89), ( 70,  7, 90), ( 70,  9, 92), ( 70, 10, 94), ( 71, 12, 95),
+    ( 71, 14, 97), ( 71, 15, 98), ( 71, 17, 99), ( 71, 18,101), ( 72, 20,102), ( 72, 21,104), ( 72, 23,105), ( 72, 24,106),
+    ( 72, 26,108), ( 72, 27,109), ( 72, 28,110), ( 72, 30,112), ( 72, 31,113), ( 72, 33,114), ( 72, 34,115), ( 72, 35,116),
+    ( 72, 37,117), ( 72, 38,118), ( 72, 39,119), ( 72, 41,120), ( 71, 42,121), ( 71, 43,122), ( 71, 45,123), ( 71, 46,124),
+    ( 71, 47,125), ( 70, 49,126), ( 70, 50,127), ( 70, 51,127), ( 69, 53,128), ( 69, 54,129), ( 69, 55,130), ( 68, 57,130),
+    ( 68, 58,131), ( 68, 59,132), ( 67, 60,132), ( 67, 62,133), ( 66, 63,133), ( 66, 64,134), ( 66, 65,134), ( 65, 67,135),
+    ( 65, 68,135), ( 64, 69,136), ( 64, 70,136), ( 63, 72,136), ( 63, 73,137), ( 62, 74,137), ( 62, 75,138), ( 61, 76,138),
+    ( 61, 78,138), ( 60, 79,138), ( 60, 80,139), ( 59, 81,139), ( 59, 82,139), ( 58, 83,139), ( 58, 85,140), ( 57, 86,140),
+    ( 56, 87,140), ( 56, 88,140), ( 55, 89,140), ( 55, 90,140), ( 54, 91,141), ( 54, 92,141), ( 53, 93,141), ( 53, 95,141),
+    ( 52, 96,141), ( 52, 97,141), ( 51, 98,141), ( 51, 99,141), ( 50,100,142), ( 50,101,142), ( 49,102,142), ( 49,103,142),
+    ( 48,104,142), ( 48,105,142), ( 48,106,142), ( 47,107,142), ( 47,108,142), ( 46,109,142), ( 46,110,142), ( 45,111,142),
+    ( 45,112,142), ( 44,113,142), ( 44,114,142), ( 44,115,142), ( 43,116,142), ( 43,118,142), ( 42,119,142), ( 42,120,142),
+    ( 42,121,142), ( 41,122,142), ( 41,123,142), ( 40,124,142), ( 40,125,142), ( 40,126,142), ( 39,127,142), ( 39,128,142),
+    ( 38,129,142), ( 38,130,142), ( 38,131,142), ( 37,132,142), ( 37,133,142), ( 36,134,142), ( 36,135,142), ( 36,136,142),
+    ( 35,137,142), ( 35,138,141), ( 35,139,141), ( 34,140,141), ( 34,141,141), ( 34,142,141), ( 33,143,141), ( 33,144,141),
+    ( 33,145,140), ( 32,146,140), ( 32,147,140), ( 32,148,140), ( 31,149,140), ( 31,150,139), ( 31,151,139), ( 31,152,139),
+    ( 31,153,138), ( 31,154,138), ( 30,155,138), ( 30,156,138), ( 30,157,137), ( 31,158,137), ( 31,159,136), ( 31,160,136),
+    ( 31,161,136), ( 31,162,135), ( 32,163,135), ( 32,164,134), ( 32,165,134), ( 33,166,133), ( 33,167,133), ( 34,168,132),
+    ( 35,169,132), ( 36,170,131), ( 36,171,130), ( 37,171,130), ( 38,172,129), ( 39,173,129), ( 40,174,128), ( 41,175,127),
+    ( 43,176,126), ( 44,177,126), ( 45,178,125), ( 47,179,124), ( 48,180,123), ( 49,181,123), ( 51,182,122), ( 53,183,121),
+    ( 54,184,120), ( 56,185,119), ( 57,186,118), ( 59,187,117), ( 61,188,116), ( 63,188,115), ( 65,189,114), ( 67,190,113),
+    ( 69,191,112), ( 70,192,111), ( 72,193,110), ( 75,194,109), ( 77,195,108), ( 79,195,106), ( 81,196,105), ( 83,197,104),
+    ( 85,198,103), ( 87,199,102), ( 90,200,100), ( 92,200, 99), ( 94,201, 98), ( 97,202, 96), ( 99,203, 95), (101,204, 93),
+    (104,204, 92), (106,205, 91), (109,206, 89), (111,207, 88), (114,207, 86), (116,208, 85), (119,209, 83), (121,209, 81),
+    (124,210, 80), (126,211, 78), (129,211, 77), (132,212, 75), (134,213, 73), (137,213, 72), (140,214, 70), (142,214, 68),
+    (145,215, 66), (148,216, 65), (151,216, 63), (153,217, 61), (156,217, 59), (159,218, 57), (162,218, 56), (165,219, 54),
+    (167,219, 52), (170,220, 50), (173,220, 48), (176,221, 46), (179,221, 45), (182,222, 43), (185,222, 41), (187,222, 39),
+    (190,223, 37), (193,223, 36), (196,224, 34), (199,224, 32), (202,224, 31), (205,225, 30), (207,225, 28), (210,226, 27),
+    (213,226, 26), (216,226, 25), (219,227, 25), (221,227, 24), (224,227, 24), (227,228, 24), (230,228, 25), (232,228, 25),
+    (235,229, 26), (238,229, 27), (240,229, 28), (243,230, 30), (246,230, 31), (248,230, 33), (251,231, 35), (253,231, 37),
+    ]
+
+def field16_script():
+    # Returns field16.js (shared with the embedded server of fifo_c.c), preceded by its colormap
+    try:
+        with open(Field16_js_path) as f:
+            script = f.read()
+    except IOError:
+        logging.error("fifofum: %s not found; 16-bit fields will not be colored", Field16_js_path)
+        return ""
+    return "var field16Viridis = %s;\n" % json.dumps([list(c) for c in Field16_viridis], separators=(",",":")) + script
+
+class Field16Handler(web.RequestHandler):
+    def get(self):
+        self.set_header("Content-Type", "application/javascript")
+        self.write(Field16_script)
+
+
 class GetHandler(web.RequestHandler):
     def get(self, path):
         opts = {"input_box": "true" if options.input else "false",
@@ -218,10 +484,34 @@ class SocketHandler(websocket.WebSocketHandler):
 
     def open(self):
         logging.warning("fifofum: websocket.open")
+        self.subscriptions = {}
+        self.trace_tid = None
+        self.trace_offset = None
         if self not in Web_sockets:
             Web_sockets.append(self)
+        publish_subscriptions()
+
+        # Send latest image of each channel
+        for msg in Last_images.values():
+            self.write_message(msg)
+
+        # Send whole history of time series (decimated)
+        for series in Series.values():
+            self.write_message(series.message())
 
     def on_message(self, message):
+        if message.startswith("fifo:subscribe"):
+            # Channels open in browser tab (not forwarded as input)
+            self.subscriptions = parse_subscriptions(message[len("fifo:subscribe"):])
+            publish_subscriptions()
+            return
+
+        if message.startswith("fifo:trace"):
+            # Frame timings from browser (not forwarded as input)
+            if Tracer is not None:
+                Tracer.browser_events(self, message[len("fifo:trace"):])
+            return
+
         if Input_pipe is not None:
             try:
                 Input_pipe.write(message+"\n")
@@ -232,23 +522,518 @@ class SocketHandler(websocket.WebSocketHandler):
     def on_close(self):
         if self in Web_sockets:
             Web_sockets.remove(self)
+        publish_subscriptions()
+
+def parse_subscriptions(tokens):
+    # Returns dict of channel name: (width, height) requested resolution, or None if not being viewed
+    subscriptions = {}
+    for token in tokens.split():
+        name, sep, res = token.partition("=")
+        if not name or not sep:
+            continue
+        try:
+            width, height = res.split("x")
+            subscriptions[name] = (int(width), int(height))
+        except ValueError:
+            subscriptions[name] = None
+    return subscriptions
+
+def publish_subscriptions():
+    # Writes union of subscriptions of all browser tabs to input pipe, as
+    #   fifo:subscribe *=0x0 name1=WxH name2=- ...
+    # (see update_subscriptions in fifo_c.c). Resolution 0x0 means any; "*" is for channels not listed.
+    global Subscriptions_line
+    if Input_pipe is None or not options.subscribe:
+        return
+
+    merged = {}
+    for ws in Web_sockets:
+        for name, res in ws.subscriptions.items():
+            prev = merged.get(name)
+            if prev is None:
+                merged[name] = res
+            elif res is not None:
+                if not prev[0] or not res[0]:
+                    merged[name] = (0, 0)
+                else:
+                    merged[name] = (max(prev[0], res[0]), max(prev[1], res[1]))
+
+    if not Web_sockets:
+        # Only channels read by this server are unsubscribed (the program may have other pipes)
+        for name in set(Channels.keys()) | set(Pipes.keys()):
+            merged[name] = None
+
+    tokens = ["*=0x0"]
+    for name, res in sorted(merged.items()):
+        tokens.append(name + "=" + ("%dx%d" % res if res else "-"))
+    line = "fifo:subscribe " + " ".join(tokens)
+    if line == Subscriptions_line:
+        return
+
+    Subscriptions_line = line
+    try:
+        Input_pipe.write(line+"\n")
+        Input_pipe.flush()
+    except Exception, excp:
+        logging.error("fifofum: publish_subscriptions: Error in transmitting to %s: %s", options.input, excp)
+
+class TileAssembler(object):
+    """Stitches image tiles with the same sequence number (possibly from different pipes) into a single image"""
+    max_pending = 4    # Maximum number of incomplete images retained
+
+    def __init__(self, name):
+        self.name = name
+        self.frames = {}
+        self.last_seq = -1
+
+    def add_tile(self, seq, x, y, width, height, global_width, global_height, data_url):
+        if seq <= self.last_seq:
+            return   # Stale tile
+
+        frame = self.frames.setdefault(seq, {"seq": seq, "width": global_width, "height": global_height,
+                                             "area": 0, "tiles": {}})
+        if (x, y) not in frame["tiles"]:
+            frame["area"] += width*height
+        frame["tiles"][(x, y)] = {"x": x, "y": y, "url": data_url}
+
+        if frame["area"] >= global_width*global_height:
+            # Image complete; discard older incomplete images
+            for old_seq in self.frames.keys():
+                if old_seq <= seq:
+                    del self.frames[old_seq]
+            self.last_seq = seq
+
+            msg = self.name + ":tiles:" + json.dumps({"seq": seq, "width": global_width, "height": global_height,
+                                                      "tiles": frame["tiles"].values()})
+            for ws in Web_sockets:
+                ws.write_message(msg)
+
+        elif len(self.frames) > self.max_pending:
+            del self.frames[min(self.frames.keys())]
+
+
+class TimeSeries(object):
+    """Keeps the whole history of a scalar time series as a pyramid of min/max buckets, so that a decimated
+    copy of bounded size is produced at constant cost, however long the series is"""
+    fanout = 4      # Samples per bucket of next level
+
+    def __init__(self, channel, name):
+        self.channel = channel
+        self.name = name
+        self.count = 0
+        self.dirty = False
+        # Each level is a flat array of buckets (t_min, v_min, t_max, v_max), where t_min/t_max are the times at which
+        # the minimum/maximum values occur; level 0 contains the samples and level k buckets of fanout**k samples
+        self.levels = [array.array("d")]
+
+    def append(self, t, value):
+        self.levels[0].extend((t, value, t, value))
+        self.count += 1
+        self.dirty = True
+
+        # Complete buckets of higher levels
+        level = 0
+        while len(self.levels[level]) % (4*self.fanout) == 0:
+            if level+1 == len(self.levels):
+                self.levels.append(array.array("d"))
+            last = self.levels[level][-4*self.fanout:]
+            t_min, v_min, t_max, v_max = last[0:4]
+            for j in range(4, len(last), 4):
+                if last[j+1] < v_min:
+                    t_min, v_min = last[j], last[j+1]
+                if last[j+3] > v_max:
+                    t_max, v_max = last[j+2], last[j+3]
+            self.levels[level+1].extend((t_min, v_min, t_max, v_max))
+            level += 1
+
+    def points(self, max_points):
+        # Returns list of (t, value) points in time order (at most about 4*max_points) from the lowest level
+        # with at most 2*max_points buckets, followed by the samples not yet merged into buckets of that level
+        level = 0
+        while len(self.levels[level]) > 8*max_points and level+1 < len(self.levels):
+            level += 1
+
+        pts = []
+        start = 0
+        for k in range(level, -1, -1):
+            buckets = self.levels[k]
+            for j in range(4*start, len(buckets), 4):
+                t_min, v_min, t_max, v_max = buckets[j:j+4]
+                if t_min == t_max:
+                    pts.append((t_min, v_min))
+                elif t_min < t_max:
+                    pts.extend(((t_min, v_min), (t_max, v_max)))
+                else:
+                    pts.extend(((t_max, v_max), (t_min, v_min)))
+            start = self.fanout*(len(buckets)//4)
+        return pts
+
+    def message(self):
+        # Returns message with decimated series (base64 encoded little-endian float64 t, value pairs)
+        pts = lttb(self.points(options.series_points), options.series_points)
+        data = struct.pack("<%dd" % (2*len(pts)), *[x for pt in pts for x in pt])
+        return self.channel + ":series:" + json.dumps({"name": self.name, "count": self.count,
+                                                       "data": base64.b64encode(data)})
+
+def lttb(pts, n_out):
+    # Largest-triangle-three-buckets downsampling of list of (t, value) points to n_out points
+    if n_out < 3 or len(pts) <= n_out:
+        return pts
+
+    sampled = [pts[0]]
+    bucket = (len(pts) - 2) / float(n_out - 2)
+    prev = pts[0]
+    for i in range(n_out - 2):
+        start = int(i*bucket) + 1
+        end = int((i+1)*bucket) + 1
+        next_end = min(int((i+2)*bucket) + 1, len(pts))
+        if next_end > end:
+            # Average of next bucket
+            avg_t = sum(p[0] for p in pts[end:next_end]) / (next_end - end)
+            avg_v = sum(p[1] for p in pts[end:next_end]) / (next_end - end)
+        else:
+            avg_t, avg_v = pts[-1]
+
+        best, best_area = pts[start], -1.0
+        for p in pts[start:end]:
+            area = abs((prev[0] - avg_t)*(p[1] - prev[1]) - (prev[0] - p[0])*(avg_v - prev[1]))
+            if area > best_area:
+                best, best_area = p, area
+        sampled.append(best)
+        prev = best
+
+    sampled.append(pts[-1])
+    return sampled
+
+def add_series(channel, line, filepath):
+    # Appends samples from series directive "name base64" (see write_series in fifo_c.c)
+    name, _, data = line.partition(" ")
+    try:
+        raw = base64.b64decode(data.strip())
+        values = struct.unpack("<%dd" % (len(raw)//8), raw[:8*(len(raw)//8)])
+    except Exception:
+        logging.error("fifofum: Invalid series directive in %s: %s", filepath, line[:80])
+        return
+
+    key = (channel, name.replace(":","_"))
+    if key not in Series:
+        Series[key] = TimeSeries(channel, key[1])
+    for j in range(0, len(values)-1, 2):
+        Series[key].append(values[j], values[j+1])
+
+def send_series():
+    # Sends decimated copy of series that have new samples (called every --series_interval seconds)
+    for series in Series.values():
+        if series.dirty and Web_sockets:
+            series.dirty = False
+            msg = series.message()
+            for ws in Web_sockets:
+                ws.write_message(msg)
+
+
+class Timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+Clock_gettime = None
+
+def monotonic_us():
+    # Returns CLOCK_MONOTONIC time in microseconds (the clock of trace lines written by fifo_c.c)
+    ts = Timespec()
+    if Clock_gettime is None or Clock_gettime(6 if sys.platform == "darwin" else 1, ctypes.byref(ts)):
+        return int(time.time()*1000000)
+    return ts.tv_sec*1000000 + ts.tv_nsec//1000
+
+class FrameTrace(object):
+    """Timestamps (CLOCK_MONOTONIC microseconds) of the stages of an image frame"""
+    def __init__(self, channel, started, assembled):
+        self.channel = channel
+        self.seq = None
+        self.library = None          # (start, encoded, written), from trace line
+        self.started = started       # first data of image line read
+        self.assembled = assembled   # image line complete
+        self.broadcast = None        # image sent to all browsers (None if skipped)
+
+class TraceWriter(object):
+    """Writes frame timings as Chrome trace events (JSON array format), with a process for each channel,
+    and threads for the library, fifofum.py and each browser"""
+    max_frames = 64    # Maximum number of broadcast frames awaiting browser timings
+
+    def __init__(self, filepath):
+        self.file = open(filepath, "w")
+        self.file.write("[")
+        self.separator = "\n"
+        self.pids = {}
+        self.threads = set()
+        self.next_tid = 3
+        self.frames = collections.OrderedDict()    # (channel, seq): FrameTrace
+
+    def write(self, event):
+        self.file.write(self.separator + json.dumps(event, separators=(",", ":")))
+        self.separator = ",\n"
+
+    def event(self, frame, tid, thread_name, name, start, end):
+        # Writes complete event for stage of frame
+        pid = self.pids.get(frame.channel)
+        if pid is None:
+            pid = self.pids[frame.channel] = len(self.pids) + 1
+            self.write({"ph": "M", "name": "process_name", "pid": pid, "args": {"name": frame.channel}})
+        if (pid, tid) not in self.threads:
+            self.threads.add((pid, tid))
+            self.write({"ph": "M", "name": "thread_name", "pid": pid, "tid": tid, "args": {"name": thread_name}})
+        self.write({"ph": "X", "name": name, "cat": "frame", "pid": pid, "tid": tid, "ts": start,
+                    "dur": max(0, end-start), "args": {"seq": frame.seq}})
+
+    def frame_events(self, frame):
+        # Writes library and fifofum.py stages of frame (after image has been broadcast, or skipped)
+        start, encoded, written = frame.library
+        self.event(frame, 1, "library", "encode", start, encoded)
+        self.event(frame, 1, "library", "write", encoded, written)
+        self.event(frame, 2, "fifofum", "read", frame.started, frame.assembled)
+        if frame.broadcast is not None:
+            self.event(frame, 2, "fifofum", "broadcast", frame.assembled, frame.broadcast)
+            self.frames[(frame.channel, frame.seq)] = frame
+            if len(self.frames) > self.max_frames:
+                self.frames.popitem(last=False)
+        self.file.flush()
+
+    def browser_events(self, ws, message):
+        # Writes browser stages of frame, from "fifo:trace {...}" message (browser times in msec)
+        now = monotonic_us()
+        try:
+            info = json.loads(message)
+            frame = self.frames.get((info["channel"], int(info["seq"])))
+            received, decoded, painted = [float(info[key]) for key in ("received", "decoded", "painted")]
+            offset = now - 1000*float(info["now"])
+        except Exception:
+            logging.error("fifofum: Invalid trace message: %s", message[:80])
+            return
+        if frame is None:
+            return
+
+        # Browser clock offset, from the earliest arriving message (overestimated by its transmission time)
+        if ws.trace_offset is None or offset < ws.trace_offset:
+            ws.trace_offset = offset
+        if ws.trace_tid is None:
+            ws.trace_tid = self.next_tid
+            self.next_tid += 1
+        received, decoded, painted = [int(ws.trace_offset + 1000*t) for t in (received, decoded, painted)]
+
+        thread_name = "browser %d" % (ws.trace_tid-2)
+        self.event(frame, ws.trace_tid, thread_name, "receive", frame.broadcast, received)
+        self.event(frame, ws.trace_tid, thread_name, "decode", received, decoded)
+        self.event(frame, ws.trace_tid, thread_name, "paint", decoded, painted)
+        self.file.flush()
+
+    def close(self):
+        self.file.write("\n]\n")
+        self.file.close()
+
+
+RAW_PREFIX = "data:image/x-raw;base64,"
+PNG_PREFIX = "data:image/png;base64,"
+
+def png_chunk(chunk_type, data):
+    return struct.pack(">I", len(data)) + chunk_type + data + struct.pack(">I", zlib.crc32(chunk_type+data) & 0xffffffff)
+
+def compress_raw(line):
+    # Converts raw image data URL to PNG data URL (in worker process), returning None on error.
+    # Raw byte format: width mod 256, width/256, height mod 256, height/256, 256*(r,g,b,a) table, width*height*color_index
+    try:
+        raw = base64.b64decode(line[len(RAW_PREFIX):])
+        width = ord(raw[0]) + 256*ord(raw[1])
+        height = ord(raw[2]) + 256*ord(raw[3])
+        rgba = raw[4:4+4*256]
+        pixels = raw[4+4*256:4+4*256+width*height]
+        if len(pixels) != width*height or not width or not height:
+            return None
+
+        # Trim palette after last color used, and transparency chunk after last non-opaque color
+        max_used = max(bytearray(pixels))
+        palette = "".join(rgba[4*p:4*p+3] for p in range(max_used+1))
+        alphas = "".join(rgba[4*p+3] for p in range(max_used+1)).rstrip("\xff")
+
+        rows = "".join("\0" + pixels[y*width:(y+1)*width] for y in range(height))  # Filter type 0 for each row
+        png = ("\x89PNG\r\n\x1a\n" +
+               png_chunk("IHDR", struct.pack(">IIBBBBB", width, height, 8, 3, 0, 0, 0)) +
+               png_chunk("PLTE", palette) +
+               (png_chunk("tRNS", alphas) if alphas else "") +
+               png_chunk("IDAT", zlib.compress(rows, 6)) +
+               png_chunk("IEND", ""))
+        return PNG_PREFIX + base64.b64encode(png)
+    except Exception:
+        return None
+
+def compress_init():
+    signal.signal(signal.SIGINT, signal.SIG_IGN)  # Interrupts are handled by the main process
+
+class ChannelQueue(object):
+    """Broadcasts the messages of a channel in order, holding messages that follow images still being compressed"""
+    max_pending = 4    # Maximum number of images being compressed (further raw images are skipped)
+    max_cached = 16    # Maximum number of compressed images cached (for unchanged frames)
+
+    def __init__(self, name):
+        self.name = name
+        self.queue = collections.deque()   # Slots [message], with None for images being compressed
+        self.pending = 0
+
+    def send(self, line, frame=None):
+        if Compress_pool is not None and line.startswith(RAW_PREFIX):
+            key = hashlib.sha1(line).digest()
+            if key in Compress_cache:
+                line = Compress_cache[key]
+            elif self.pending >= self.max_pending:
+                return   # Workers are behind; skip frame
+            else:
+                slot = [None, frame]
+                self.queue.append(slot)
+                self.pending += 1
+                callback = lambda png_line: IO_loop.add_callback(self.compressed, slot, key, png_line or line)
+                Compress_pool.apply_async(compress_raw, (line,), callback=callback)
+                return
+
+        if self.queue:
+            self.queue.append([line, frame])
+        else:
+            self.broadcast(line, frame)
+
+    def compressed(self, slot, key, line):
+        # Called in IO loop, when image has been compressed
+        self.pending -= 1
+        slot[0] = line
+        Compress_cache[key] = line
+        if len(Compress_cache) > self.max_cached:
+            Compress_cache.popitem(last=False)
+
+        while self.queue and self.queue[0][0] is not None:
+            self.broadcast(*self.queue.popleft())
+
+    def broadcast(self, line, frame=None):
+        if frame is not None and line.startswith("trace:"):
+            # Sequence number of traced image (sent after the image, unless it was skipped)
+            Tracer.frame_events(frame)
+            if frame.broadcast is None:
+                return
+
+        msg = self.name + ":" + line
+        if line.startswith("data:image/"):
+            Last_images[self.name] = msg
+        for ws in Web_sockets:
+            ws.write_message(msg)
+
+        if frame is not None and frame.broadcast is None:
+            frame.broadcast = monotonic_us()
+
+
+MMAP_MAGIC = "FIFOMMAP"
+MMAP_HDRLEN = 64
 
 class PipeReader(object):
     def __init__(self, name, filepath):
         self.name = name
         self.filepath = filepath
+        self.socket = None
+        self.polled = False
         if filepath in "-_":
             self.file = None
             self.fd = 0          # stdin
+        elif stat.S_ISREG(os.stat(filepath).st_mode):
+            # Latest-frame file or memory-mapped file (polled)
+            self.polled = True
+            self.file = None
+            self.fd = None
+            self.mmap = None
+            self.file_id = None
+            self.last_frame = None
+        elif stat.S_ISSOCK(os.stat(filepath).st_mode):
+            # Socket pipe (shared with other readers)
+            self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.socket.connect(filepath)
+            self.file = None
+            self.fd = self.socket.fileno()
         else:
             self.file = open(filepath, "r")
             self.fd = self.file.fileno()
 
-        fcntl.fcntl(self.fd, fcntl.F_SETFL, fcntl.fcntl(self.fd, fcntl.F_GETFL)|os.O_NONBLOCK) # Non-blocking
+        if not self.polled:
+            fcntl.fcntl(self.fd, fcntl.F_SETFL, fcntl.fcntl(self.fd, fcntl.F_GETFL)|os.O_NONBLOCK) # Non-blocking
 
         self.line_buffer = []
         self.channel = ""
+        self.tile = None
+        self.skip_line = True
+        self.frame = None          # Traced image awaiting trace line
+        self.line_started = None
+
+    def reconnect(self):
+        # Reconnect to socket pipe after writer has closed it
+        try:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(self.filepath)
+        except Exception, excp:
+            IO_loop.call_later(1, self.reconnect)
+            return
+
+        logging.warning("fifofum: Reconnected to socket %s", self.filepath)
+        self.socket = sock
+        self.fd = sock.fileno()
+        fcntl.fcntl(self.fd, fcntl.F_SETFL, fcntl.fcntl(self.fd, fcntl.F_GETFL)|os.O_NONBLOCK) # Non-blocking
+        self.line_buffer = []
         self.skip_line = True
+        IO_loop.add_handler(self.fd, self.on_read, IO_loop.READ)
+
+    def start_polling(self):
+        ioloop.PeriodicCallback(self.poll, int(1000*options.poll)).start()
+
+    def poll(self):
+        # Process new frame, if any, from latest-frame file or memory-mapped file
+        try:
+            st = os.stat(self.filepath)
+        except OSError:
+            return      # Being renamed/recreated
+
+        if self.mmap is not None and st.st_ino != self.file_id:
+            # Memory-mapped file recreated
+            self.mmap.close()
+            self.mmap = None
+
+        if self.mmap is None:
+            try:
+                with open(self.filepath, "rb") as f:
+                    if f.read(len(MMAP_MAGIC)) == MMAP_MAGIC:
+                        self.mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                        self.file_id = st.st_ino
+                        self.last_frame = None
+                    elif (st.st_ino, st.st_mtime, st.st_size) != self.file_id:
+                        # New frame published (by rename)
+                        self.file_id = (st.st_ino, st.st_mtime, st.st_size)
+                        f.seek(0)
+                        self.process_frame(f.read())
+                        return
+            except IOError:
+                return
+
+        if self.mmap is None:
+            return
+
+        slot_size, seq = struct.unpack_from("=IQ", self.mmap, 12)
+        if seq == self.last_frame:
+            return
+        active, len0, len1 = struct.unpack_from("=III", self.mmap, 24)
+        offset = MMAP_HDRLEN + active*slot_size
+        length = len1 if active else len0
+        if offset + length > min(len(self.mmap), st.st_size):
+            return
+        data = self.mmap[offset:offset+length]
+        if struct.unpack_from("=Q", self.mmap, 16)[0] != seq:
+            return      # Frame overwritten while copying; retry at next poll
+        self.last_frame = seq
+        self.process_frame(data)
+
+    def process_frame(self, data):
+        # Each frame is complete
+        self.line_buffer = []
+        self.skip_line = False
+        self.process_data(data)
 
     def on_read(self, fd, events):
         try:
@@ -257,9 +1042,23 @@ class PipeReader(object):
             logging.error("fifofum: on_read: Error in reading from %s: %sd", self.filepath, excp)
             data = ""
             self.skip_line = True
-            time.sleep(1)
-    
+            if not self.socket:
+                time.sleep(1)
+
+        if not data and self.socket:
+            # Socket pipe closed by writer
+            IO_loop.remove_handler(self.fd)
+            self.socket.close()
+            IO_loop.call_later(1, self.reconnect)
+            return
+
+        self.process_data(data)
+
+    def process_data(self, data):
         while data:
+            if Tracer is not None and not self.line_buffer:
+                self.line_started = monotonic_us()
+
             # Search for line break
             head, sep, data = data.partition("\n")
 
@@ -281,6 +1080,11 @@ class PipeReader(object):
                 ##print "CHANNEL: ", self.channel
                 continue
 
+            if full_line.startswith("tile:"):
+                # Tile directive line (for next image)
+                self.tile = full_line[5:].split()
+                continue
+
             if not full_line.startswith("data:"):
                 # Not channel or data directive
                 if self.skip_line:
@@ -288,6 +1092,26 @@ class PipeReader(object):
                     self.skip_line = False
                     continue
 
+                if full_line.startswith("series:"):
+                    # Time series samples (not passed through)
+                    if self.channel or not options.multiplex:
+                        add_series(self.channel if self.channel else self.name, full_line[7:], self.filepath)
+                    continue
+
+                if full_line.startswith("trace:"):
+                    # Timings of preceding image from library (not passed through)
+                    frame, self.frame = self.frame, None
+                    if frame is not None:
+                        try:
+                            values = [int(val) for val in full_line[6:].split()]
+                            frame.seq, frame.library = values[0], tuple(values[1:4])
+                        except Exception:
+                            logging.error("fifofum: Invalid trace directive in %s: %s", self.filepath, full_line)
+                            continue
+                        if len(frame.library) == 3:
+                            Channels[frame.channel].send("trace:%d" % frame.seq, frame)
+                    continue
+
                 if options.passthru:
                     # Transmit to STDOUT
                     if len(Pipes) > 1:
@@ -299,14 +1123,32 @@ class PipeReader(object):
                 # Channel must be defined for multiplexed pipes before data is processed (to avoid processing incomplete line blocks)
                 continue   # Discard line
 
+            if self.tile and full_line.startswith("data:"):
+                # Image tile (not traced)
+                tile, self.tile = self.tile, None
+                self.frame = None
+                try:
+                    tile_name = tile[0].replace(":","_")
+                    seq, x, y, width, height, global_width, global_height = [int(val) for val in tile[1:8]]
+                except Exception:
+                    logging.error("fifofum: Invalid tile directive in %s: %s", self.filepath, tile)
+                    continue
+
+                if tile_name not in Tiles:
+                    Tiles[tile_name] = TileAssembler(tile_name)
+                Tiles[tile_name].add_tile(seq, x, y, width, height, global_width, global_height, full_line)
+                continue
+
             # Transmit buffered line as message pipeName:data_URL or plain text line
             channel_name = self.channel if self.channel else self.name
 
-            msg = channel_name + ":" + full_line
+            if channel_name not in Channels:
+                Channels[channel_name] = ChannelQueue(channel_name)
 
-            ##print "MSG: ", msg
-            for ws in Web_sockets:
-                ws.write_message(msg)
+            frame = None
+            if Tracer is not None and full_line.startswith("data:image/"):
+                frame = self.frame = FrameTrace(channel_name, self.line_started, monotonic_us())
+            Channels[channel_name].send(full_line, frame)
 
         
 def stop_server():
@@ -314,22 +1156,43 @@ def stop_server():
     IO_loop.stop()
 
 def main():
-    global Http_server, Input_pipe, IO_loop, Pipes
+    global Http_server, Input_pipe, IO_loop, Pipes, Compress_pool, Tracer, Clock_gettime, Field16_script
 
     define("addr", default="127.0.0.1", help="IP address")
     define("port", default=8008, help="IP port")
     define("input", default="", help="Input capture pipe file")
+    define("subscribe", default=0, help="subscribe=1 to write channels being viewed to input pipe (as fifo:subscribe lines)")
     define("passthru", default=0, help="passthru=1 to pass through non-image output to stdout")
     define("multiplex", default=0, help="multiplex=1 for multiplexed pipes")
     define("background", default="", help="URL of background image")
+    define("poll", default=0.1, help="Polling interval (sec) for latest-frame and memory-mapped files")
+    define("series_points", default=1000, help="Maximum number of points plotted for each time series")
+    define("series_interval", default=0.5, help="Minimum interval (sec) between updates of time series plots")
+    define("compress", default=0, help="Number of worker processes compressing raw images to PNG (0 for none)")
+    define("trace", default="", help="Chrome trace file (JSON) for recording frame timings")
 
     options.logging = None
     args = parse_command_line()
 
     if not args:
-        sys.exit("Usage: fifofum.py [--addr=...] [--port=...] [--multiplex=1] [--passthru=1] [--input=pipe0.fifo] pipe1.fifo ...")
+        sys.exit("Usage: fifofum.py [--addr=...] [--port=...] [--multiplex=1] [--passthru=1] [--compress=N] [--trace=file.json] [--input=pipe0.fifo [--subscribe=1]] pipe1.fifo ...")
+
+    if options.compress > 0:
+        # Start workers before the IO loop (and any other threads)
+        Compress_pool = multiprocessing.Pool(options.compress, compress_init)
+        logging.warning("fifofum: Compressing raw images using %d worker processes", options.compress)
+
+    if options.trace:
+        try:
+            Clock_gettime = ctypes.CDLL(None, use_errno=True).clock_gettime
+            Clock_gettime.argtypes = [ctypes.c_int, ctypes.POINTER(Timespec)]
+        except Exception:
+            logging.error("fifofum: clock_gettime not available; trace times will not match library times")
+        Tracer = TraceWriter(options.trace)
+        logging.warning("fifofum: Recording frame timings in %s", options.trace)
 
     IO_loop = ioloop.IOLoop.instance()
+    ioloop.PeriodicCallback(send_series, int(1000*options.series_interval)).start()
 
     for arg in args:
         if arg not in "-_" and not os.path.exists(arg):
@@ -338,6 +1201,9 @@ def main():
         name = os.path.splitext(os.path.basename(arg))[0].replace(":","_").replace(" ","_") # No colons/spaces allowed in channel name
         logging.warning("fifofum: Opening pipe %s: %s", name, arg)
         Pipes[name] = PipeReader(name, arg)
+        if Pipes[name].polled:
+            Pipes[name].start_polling()
+            continue
         fhandle = Pipes[name].file if Pipes[name].file else Pipes[name].fd  # Note: using fd does not always seem to work
         IO_loop.add_handler(fhandle, Pipes[name].on_read, IO_loop.READ)
 
@@ -346,8 +1212,10 @@ def main():
         logging.warning("fifofum: Transmitting input via %s", options.input)
         print Input_pipe
 
+    Field16_script = field16_script()
     handlers = [
         (r"/ws", SocketHandler),
+        (r"/field16.js", Field16Handler),
         ]
 
     if os.path.isdir(Doc_rootdir):
@@ -364,7 +1232,11 @@ def main():
     logging.warning("fifofum: Listening on %s:%d %s", options.addr, options.port, dir_msg)
 
 
-    IO_loop.start()
+    try:
+        IO_loop.start()
+    finally:
+        if Tracer is not None:
+            Tracer.close()
 
 if __name__ == "__main__":
     main()